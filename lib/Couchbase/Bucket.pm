@@ -6,6 +6,7 @@ use warnings;
 use Couchbase::JSON;
 use URI;
 use Storable;
+use Time::HiRes ();
 
 use Couchbase::Core;
 use Couchbase::_GlueConstants;
@@ -17,8 +18,6 @@ use Couchbase::HTTPDocument;
 use Couchbase::N1QL::Handle;
 
 my $_JSON = Couchbase::JSON->new()->allow_nonref;
-sub _js_encode { $_JSON->encode($_[0]) }
-sub _js_decode { $_JSON->decode($_[0]) }
 
 sub new {
     my ($pkg, $connstr, $opts) = @_;
@@ -32,36 +31,47 @@ sub new {
 
     die "Must have connection string" unless $options{connstr};
     my $noconn = delete $options{no_init_connect};
+    my $cache = delete $options{cache};
+    my $negcache = delete $options{negative_cache};
+    my $autobatch = delete $options{autobatch};
+    my $inflight = delete $options{inflight};
+    my $compression = delete $options{compression};
+    my $sereal = delete $options{sereal} || {};
     my $self = $pkg->construct(\%options);
     $self->connect() unless $noconn;
 
-    $self->_encoder(CONVERTERS_JSON, \&_js_encode);
-    $self->_decoder(CONVERTERS_JSON, \&_js_decode);
+    if ($cache) {
+        $self->cache_configure($cache->{max_items}, $cache->{max_age} || 0);
+    }
+    if ($negcache) {
+        $self->negative_cache_configure($negcache->{max_items} || 10000, $negcache->{ttl});
+    }
+    if ($autobatch) {
+        $self->autobatch_configure($autobatch->{max_ops} || 64,
+            $autobatch->{max_bytes} || 0, $autobatch->{max_delay} // 0.0005);
+    }
+    if ($inflight) {
+        $self->inflight_configure($inflight->{max_ops} || 0,
+            $inflight->{max_bytes} || 0, $inflight->{on_drain});
+    }
+    if ($compression) {
+        my $dicts = $compression->{dictionaries} || {};
+        while (my ($id, $dict) = each %$dicts) {
+            $self->compression_add_dictionary($id, $dict);
+        }
+        $self->compression_configure($compression->{method},
+            $compression->{min_size} || 0, $compression->{dictionary} || 0);
+    }
+
     $self->_encoder(CONVERTERS_STORABLE, \&Storable::freeze);
     $self->_decoder(CONVERTERS_STORABLE, \&Storable::thaw);
-    return $self;
-}
 
-sub __statshelper {
-    my ($doc, $server, $key, $value) = @_;
-    if (!$doc->value || ref $doc->value ne 'HASH') {
-        $doc->value({});
-    }
-    ($doc->value->{$server} ||= {})->{$key} = $value;
-}
-
-sub __obshelper {
-    my ($doc,$status,$cas,$ismaster) = @_;
-    my $obj = {
-        status => $status,
-        cas => $cas,
-        master=> $ismaster
-    };
-    if (ref $doc->value ne 'ARRAY') {
-        $doc->value([$obj]);
-    } else {
-        push @{$doc->value}, $obj;
+    # Sereal is optional, and only needed for COUCHBASE_FMT_SEREAL
+    if (eval { require Sereal::Encoder; require Sereal::Decoder; 1 }) {
+        $self->_sereal_init(Sereal::Encoder->new($sereal->{encoder} || {}),
+                            Sereal::Decoder->new($sereal->{decoder} || {}));
     }
+    return $self;
 }
 
 sub _dispatch_stats {
@@ -135,6 +145,65 @@ sub transform_id {
     return $self->transform($doc, $xfrm);
 }
 
+# Like transform(), but for many documents at once. All documents are fetched
+# and replaced in batches, and only those which failed with a CAS mismatch
+# are fetched again and retried.
+sub transform_multi {
+    my ($self, $ids, $xfrm) = @_;
+    # The timeout setting is in seconds
+    my $end = Time::HiRes::time() + $self->settings()->{operation_timeout};
+
+    my $results = $self->get_multi($ids);
+    my @pending = grep { $_->is_ok } values %$results;
+
+    while (@pending && Time::HiRes::time() < $end) {
+        my @modified;
+
+        # Apply all the transformations before the batch is created, so the
+        # callback may itself use the bucket
+        foreach my $doc (@pending) {
+            my $value = $doc->value;
+            next unless $xfrm->(\$value, $doc);
+            $doc->value($value);
+            push @modified, $doc;
+        }
+        last unless @modified;
+
+        my $batch = $self->batch();
+        $batch->replace($_) for @modified;
+        $batch->wait_all();
+
+        my @retry = map { $_->id } grep { $_->is_cas_mismatch } @modified;
+        last unless @retry;
+
+        my $fresh = $self->get_multi(\@retry);
+        @$results{keys %$fresh} = values %$fresh;
+        @pending = grep { $_->is_ok } values %$fresh;
+    }
+
+    return $results;
+}
+
+sub compression_train {
+    my ($self, $source, $options) = @_;
+    $options ||= {};
+    my @samples;
+
+    if (ref $source eq 'ARRAY') {
+        my $results = $self->get_multi($source);
+        @samples = map { $_->value } grep { $_->is_ok } values %$results;
+    } elsif (ref $source && $source->isa('Couchbase::View::Handle')) {
+        while (my $row = $source->next) {
+            my $doc = $row->doc or next;
+            push @samples, $doc->[RETIDX_VALUE] if defined $doc->[RETIDX_VALUE];
+        }
+    } else {
+        die("Samples must be an array of IDs or a view iterator");
+    }
+
+    return $self->_compression_train(\@samples, $options->{size} || 16384);
+}
+
 sub settings {
     my $self = shift;
     tie my %h, 'Couchbase::Settings', $self;
@@ -380,8 +449,39 @@ C<password> option in the C<$options> hashref in the constructor.
 
 
 Create a new connection to a bucket. C<$connstr> is a L<"Connection String"> and
-C<$options> is a hashref of options. The only recognized option key is C<password>
-which is the bucket password, if applicable.
+C<$options> is a hashref of options. The recognized option keys are C<password>,
+which is the bucket password, if applicable, and C<cache>, which enables the
+L<"Read-Through Cache"> and contains the options for C<cache_configure>:
+
+    my $cb = Couchbase::Bucket->new($connstr, { cache => { max_items => 5000, max_age => 2 } });
+
+Likewise, C<negative_cache> enables the L<"Negative Cache">, and may contain the
+C<ttl> and C<max_items> keys.
+
+For asynchronous buckets, the C<autobatch> option enables L<"Auto-Batching">,
+and may contain the C<max_ops>, C<max_bytes> and C<max_delay> keys. The
+C<inflight> option sets L<"In-Flight Limits">, and may contain the C<max_ops>,
+C<max_bytes> and C<on_drain> keys.
+
+The C<compression> option enables L<"Value Compression">, and may contain the
+C<method>, C<min_size> and C<dictionary> keys, as well as a C<dictionaries>
+hash of dictionary IDs to dictionaries to load.
+
+If C<lazy_decode> is true, values retrieved with C<get()> and related methods
+are not decoded until the document's C<value> is first read. This saves the
+cost of decoding when only checking for existence, the CAS, or when storing
+the document elsewhere unchanged. A document with a pending value holds a
+reference to the bucket until it is decoded or destroyed.
+
+If C<strict_utf8> is true, values in the C<utf8> and C<json> formats are checked
+to be valid UTF-8 before being decoded. A value which is not is returned as a
+byte string, with a warning, rather than as a malformed character string.
+Storing a character string with surrogates or code points above C<U+10FFFF>
+in the C<utf8> format is also an error.
+
+The C<sereal> option may contain C<encoder> and C<decoder> hashes, which are
+passed to the constructors of L<Sereal::Encoder> and L<Sereal::Decoder> for use
+with the C<sereal> format (see L<Couchbase::Document/"format()">).
 
 This method will attempt to connect to the cluster, and die if a connection could
 not be made.
@@ -418,6 +518,50 @@ the item. See L<"Document Expiration"> for more details:
     my $doc = Couchbase::Document->new("id", { expiry => 300 });
     $cb->get_and_touch($doc); # Expires in 5 minutes
 
+The C<get> method accepts a C<hedge_after> option, which is a number of
+seconds (which may be fractional). If the active node has not responded within
+this time, a replica read (see L<get_from_replica>) is issued as well, and the
+document is completed by whichever response arrives first. This bounds the
+latency of reads during a failover or when a node is slow, at the cost of some
+extra traffic and possibly reading a slightly older value:
+
+    $cb->get($doc, { hedge_after => 0.005 });
+
+C<hedge_stats()> returns a hash reference with the number of replica reads
+C<sent> by hedged gets so far, and the number of gets C<won> by the replica
+read.
+
+
+=head3 get_from_replica($doc, $options)
+
+Retrieve a document from a replica node rather than the active node. This may
+be used to read an item while its active node is unavailable, for example
+during a failover. Note that the value read may be older than the one on the
+active node.
+
+The C<strategy> option determines which replicas are queried:
+
+=over
+
+=item C<first>
+
+Query each replica in turn, and return the first successful response. This is
+the default.
+
+=item C<all>
+
+Query all replicas. If more than one replica responds, the copy with the
+highest L<CAS|"CAS Operations"> is used.
+
+=item C<index>
+
+Query only the replica specified by the C<index> option (starting at 0).
+
+=back
+
+    my $doc = Couchbase::Document->new("id_to_retrieve");
+    $cb->get_from_replica($doc, { strategy => 'index', index => 0 });
+
 
 =head3 fetch($id)
 
@@ -480,6 +624,10 @@ in the L<Couchbase::Document> object, like so:
 This version of the client uses so-called "Common Flags", allowing seamless integration
 with Couchbase clients written in other languages.
 
+For values which only need to be read by Perl, C<COUCHBASE_FMT_SEREAL> is faster
+and more compact than C<COUCHBASE_FMT_STORABLE>. It requires L<Sereal::Encoder>
+and L<Sereal::Decoder> to be installed.
+
 
 =head4 Encoding Formats
 
@@ -543,6 +691,20 @@ which may be less than the number of replicas the bucket was configured with.
 
 You may request replication without persistence by simply setting C<replicate_to=0>.
 
+When several stores within the same batch request durability, their checks are
+combined and only begin once all the stores in the batch have completed. Stores
+sharing the same requirements are then polled together, so that each node is
+sent one set of observe requests for the whole batch, rather than one per
+document.
+
+By default, durability is checked by comparing the document's CAS on each node.
+When a document is modified frequently, the CAS may change before the check
+completes. Passing C<< durability_mode => 'seqno' >> to the constructor checks
+durability by the sequence number in the document's mutation token instead (see
+L<Couchbase::Document/mutation_token>). A store whose server did not return a
+token falls back to the CAS check. Documents passed to C<durability_batch> in
+this mode must carry a mutation token.
+
 
 =head4 Document Expiration
 
@@ -594,6 +756,189 @@ Set a high timeout for a specified operation:
     }
 
 
+=head3 Read-Through Cache
+
+The client may keep a local cache of recently retrieved values, which is
+useful for small documents which are read frequently and change rarely, such
+as configuration or feature flags.
+
+When enabled, each successful C<get> stores the value as received from the
+server, along with its CAS. A later C<get> for the same ID within C<max_age>
+seconds is answered from the cache without contacting the server. Once an entry
+is older than this, the next C<get> goes to the server and the entry is
+refreshed.
+
+Entries are removed when the document is modified or removed through the same
+bucket object. Changes made by other clients may go unnoticed for up to
+C<max_age> seconds.
+
+Only synchronous C<get> calls outside of a L<batch()> are answered from the
+cache. Each read decodes its own copy of the value, so modifying a fetched
+value in place does not affect the cache.
+
+=head4 cache_configure($max_items, $max_age)
+
+Enables the cache, or changes its settings. C<$max_items> is the number of
+documents kept, with the least recently used entries evicted first. Passing
+0 disables the cache.
+
+=head4 cache_stats()
+
+Returns a hashref with the C<hits>, C<misses>, C<revalidated> (stale entries
+whose CAS was unchanged) and C<evictions> counters, and the current number of
+C<items>.
+
+=head4 cache_clear()
+
+Removes all entries from the cache, and from the L<"Negative Cache">.
+
+
+=head3 Negative Cache
+
+If many lookups are for documents which do not exist, the client may remember
+IDs for which a C<get> recently failed with C<COUCHBASE_KEY_ENOENT>. Further
+C<get> calls for these IDs within the TTL fail immediately with the same error,
+without contacting the server.
+
+Storing a document, or creating it with C<counter>, through the same bucket
+object removes its ID from the negative cache. Documents created by other
+clients may still be reported as missing for up to the TTL.
+
+As with the read-through cache, only synchronous C<get> calls outside of a
+L<batch()> are answered locally. The C<negative_hits> and C<negative_items>
+counters are reported by C<cache_stats>.
+
+=head4 negative_cache_configure($max_items, $ttl)
+
+Enables the negative cache, keeping up to C<$max_items> IDs for C<$ttl>
+seconds each. Passing 0 for either value disables it.
+
+
+=head3 Shared Encodings
+
+When the same structure is stored to many IDs in one multi store, for example
+a template value, it is only encoded once and the encoded form is sent for
+each ID. This applies to references (hashes, arrays and objects) stored in the
+C<json>, C<storable> and C<sereal> formats, and structures are found by their
+identity:
+
+    my $template = { type => "user", roles => [ "reader" ] };
+    $cb->upsert_multi({ map { ("user_$_" => $template) } (1..1000) });
+
+Encodings are only shared within a single call to C<upsert_multi>,
+C<insert_multi> or C<replace_multi>, so a structure modified in place is
+always encoded again the next time it is stored. A C<json_encoder>, Storable
+hook or Sereal C<FREEZE> method called during the store must not modify the
+other values being stored.
+
+The C<encode_hits> and C<encode_misses> counters are reported by
+C<cache_stats>.
+
+
+=head3 Auto-Batching
+
+In async mode, each operation performed outside of a L<batch()> is normally
+sent to the network as soon as it is scheduled. When many independent
+operations are issued from the same event loop iteration, they may instead be
+held back briefly and sent together, so that operations for the same node are
+written at once.
+
+Pending operations are sent once C<max_ops> of them are waiting, once their keys
+and values total C<max_bytes>, or after C<max_delay> seconds, whichever comes
+first. They are also sent before any L<batch()> or multi operation is started.
+
+=head4 autobatch_configure($max_ops, $max_bytes, $max_delay)
+
+Enables auto-batching. C<$max_bytes> defaults to no limit and C<$max_delay> to
+half a millisecond. Passing 0 for C<$max_ops> disables it, sending any pending
+operations. This dies if the bucket is not in async mode.
+
+
+=head3 In-Flight Limits
+
+An async bucket otherwise schedules every operation it is given, however many
+are still awaiting a response. During a burst this can queue far more
+operations than the cluster can answer before they time out.
+
+With limits set, an operation started while C<max_ops> operations are awaiting
+a response, or while their keys and values total C<max_bytes>, is not
+scheduled. Its document's C<errnum> is set to C<COUCHBASE_EBUSY> and the
+method returns false, without invoking the context's callback. For
+multi operations, only the documents over the limit fail this way.
+
+Once operations have been rejected, the C<on_drain> callback is invoked, with
+no arguments, as soon as a completed operation brings the bucket back under
+its limits. The application may then resume issuing operations. If the
+callback dies, its error is emitted as a warning.
+
+=head4 inflight_configure($max_ops, $max_bytes, $on_drain)
+
+Sets the limits. A limit of 0 means no limit. This dies if the bucket is not in
+async mode.
+
+=head4 inflight_stats()
+
+Returns a hash reference with the number of C<ops> awaiting a response, the
+C<bytes> of their keys and values not yet responded to, the configured
+C<max_ops> and C<max_bytes>, and the number of operations C<rejected> so far.
+
+
+=head3 Value Compression
+
+Values in the C<json> and C<storable> formats may be compressed by the client
+before they are stored. The method is recorded in the compression bits of the
+common item flags, and compressed values are decompressed automatically when
+retrieved, whether or not compression is enabled on the reading client. A value
+is only stored compressed if that makes it smaller. Clients which do not
+support compression cannot read compressed values.
+
+Compressed documents are opaque to the server. They cannot be used with
+sub-document operations, and are not visible to views or N1QL queries. Values
+in the C<raw> and C<utf8> formats are never compressed, so that they may still
+be appended to.
+
+Support for each method must be enabled when building the module, using
+C<perl Makefile.PL --with-lz4> and/or C<--with-zstd>.
+
+=head4 compression_configure($method, $min_size, $dictionary)
+
+Compresses values of at least C<$min_size> bytes (after encoding) with
+C<$method>, which is either C<lz4> or C<zstd>. Passing C<undef> or C<none>
+disables compression.
+
+For C<zstd>, C<$dictionary> may be the ID of a dictionary previously added with
+L<"compression_add_dictionary($id, $dict)">. Small JSON documents typically
+compress several times better against a dictionary trained on similar
+documents than on their own.
+
+=head4 compression_add_dictionary($id, $dict)
+
+Loads a C<zstd> dictionary under C<$id>, which must be between 1 and 65535.
+The ID is recorded in the header of each value compressed with it, and every
+client reading such values must have the same dictionary loaded under the
+same ID. Adding a dictionary with an existing ID replaces it, so dictionaries
+should never be changed once values have been stored with them; train a new
+one under a new ID instead.
+
+A convenient way to distribute dictionaries is to store them in the bucket
+itself, as documents in the C<raw> format.
+
+=head4 compression_train($source, $options)
+
+Trains a new C<zstd> dictionary and returns it as a byte string. C<$source> is
+either an array reference of document IDs, or a view iterator created with the
+C<include_docs> option (see L<"VIEW (MAPREDUCE) QUERIES">).
+The documents are fetched and re-encoded as JSON to form the samples.
+
+C<$options> may contain C<size>, the maximum size of the dictionary, which
+defaults to 16KB. A few hundred to a few thousand representative documents
+should be used; training dies if there are too few samples.
+
+    my $dict = $cb->compression_train(
+        $cb->view_iterator("sessions/all", include_docs => 1, limit => 2000));
+    $cb->upsert(Couchbase::Document->new("zdict:1", $dict, { format => 'raw' }));
+    $cb->compression_add_dictionary(1, $dict);
+    $cb->compression_configure('zstd', 64, 1);
 
 
 =head2 ADVANCED DATA ACCESS
@@ -667,6 +1012,63 @@ Thus a JSON string may be stored as C<"foo">, and appending to it
 will yield C<"foo"bar>, which is typically not what you want.
 
 
+=head2 SUB-DOCUMENT OPERATIONS
+
+These methods operate on individual paths within a JSON document, rather than
+on the entire document. Only the relevant fragments are transferred over the
+network, which is considerably more efficient when a small part of a large
+document is read or modified.
+
+The operations to perform are passed in the C<spec> option as a list of
+C<[ $op, $path, $value ]> entries. Paths use the server's syntax, for example
+C<name>, C<address.city> or C<tags[0]>. Values are always encoded as JSON.
+
+When the operation completes, the document's C<value> is replaced with a hash
+of C<< path => result >>, and its CAS is updated. If any path fails, the
+document's status will reflect this, but the results of the paths which
+succeeded are still available.
+
+
+=head3 lookup_in($doc, { spec => [ [ $op, $path ], ... ] })
+
+Retrieve paths from the document. C<$op> may be one of:
+
+=over
+
+=item C<get>
+
+Retrieve the value at the path.
+
+=item C<exists>
+
+Check whether the path exists. The result is true or false.
+
+=back
+
+    my $doc = Couchbase::Document->new("user:mnunberg");
+    $cb->lookup_in($doc, { spec => [ [ get => 'name' ], [ exists => 'email' ] ] });
+    printf("Name is %s\n", $doc->value->{name});
+
+
+=head3 mutate_in($doc, { spec => [ [ $op, $path, $value ], ... ] })
+
+Modify paths within the document. All the operations are applied atomically.
+C<$op> may be one of C<upsert>, C<insert>, C<replace>, C<remove>,
+C<array_append>, C<array_prepend>, C<array_add_unique> and C<counter>.
+For C<counter> the value is the delta, and the result contains the new value.
+
+    $cb->mutate_in($doc, { spec => [
+        [ upsert => 'address.city', 'Reno' ],
+        [ counter => 'visits', 1 ],
+        [ array_append => 'tags', 'new' ]
+    ], create_parents => 1 });
+    printf("Visited %d times\n", $doc->value->{visits});
+
+As with L<replace>, the document's CAS is checked unless the C<ignore_cas>
+option is specified. The C<create_parents> option creates any missing parent
+paths for the mutations.
+
+
 =head2 PESSIMISTIC LOCKING
 
 Pessimistic locking will pre-emptively lock an item to avoid modifications
@@ -751,9 +1153,119 @@ To create a new context, use the C<batch> method
 
 =head3 batch()
 
+=head3 batch($options)
+
 Returns a new L<Couchbase::OpContext> which may be used to schedule
 operations.
 
+The same document ID may be used by more than one operation within a batch,
+for example to read a key several times. Each operation updates the
+L<Couchbase::Document> it was passed.
+
+Passing C<< decode => 'deferred' >> in C<$options> keeps retrieved values
+undecoded until C<wait_all()> returns, at which point they are all decoded
+together. Documents returned by C<wait_one()> are decoded when their value
+is first accessed. With a custom JSON decoder, a C<decode_many> function may
+also be passed. It receives a reference to an array of all the JSON strings in
+the batch and must return a reference to an array of the decoded values, in
+the same order, so that the decoder is called once per batch rather than once
+per document. Deferred decoding is not available for async buckets:
+
+    my $ctx = $cb->batch({
+        decode => 'deferred',
+        decode_many => sub { [ map { $json->decode($_) } @{$_[0]} ] }
+    });
+    $ctx->get($_) for @docs;
+    $ctx->wait_all;
+
+Any number of batches may be open or in flight at the same time, and each one
+tracks only its own operations. All of them share the bucket's connection, so
+waiting on one batch also sends the operations already added to the others,
+and processes their responses as they arrive. Operations outside a batch may
+also be performed while batches are open:
+
+    my $slow = $cb->batch;
+    $slow->upsert($_, { persist_to => 1 }) for @docs;
+    my $fast = $cb->batch;
+    $fast->get($_) for @lookups;
+    $fast->wait_all;    # Returns without waiting for persistence
+    $slow->wait_all;
+
+
+=head2 MULTI-KEY OPERATIONS
+
+When the same operation is to be performed on many items, the C<_multi>
+variants are more efficient than a L<batch()>, as the options are only
+parsed once and the documents are created internally rather than being
+passed in one at a time.
+
+Each of these methods accepts an arrayref of IDs and an optional hashref
+of options which apply to all the IDs. They return a hashref of
+C<< id => Couchbase::Document >>:
+
+    my $res = $cb->get_multi([qw(foo bar baz)]);
+    while (my ($id, $doc) = each %$res) {
+        if ($doc->is_ok) {
+            printf("%s => %s\n", $id, $doc->value);
+        }
+    }
+
+
+=head3 get_multi(\@ids)
+
+=head3 get_and_touch_multi(\@ids, { exp => $seconds })
+
+=head3 touch_multi(\@ids, { exp => $seconds })
+
+=head3 remove_multi(\@ids)
+
+=head3 counter_multi(\@ids, { delta => n1, initial => n2 })
+
+These function like their single-document counterparts. Since the documents
+are created internally, C<remove_multi> does not perform any
+L<CAS|"CAS Operations"> checking. The same ID may be specified more than
+once, but will only be operated on once.
+
+
+=head3 upsert_multi(\%values, $options)
+
+=head3 upsert_multi(\@ids, \@values, $options)
+
+=head3 insert_multi(...)
+
+=head3 replace_multi(...)
+
+Store multiple values at once. The values may be passed either as a hashref
+of C<< id => value >>, or as two parallel arrayrefs of IDs and values.
+
+    my $res = $cb->upsert_multi({ foo => [1,2,3], bar => { a => 'b' } });
+    $res = $cb->insert_multi(\@ids, \@values, { exp => 300 });
+
+The C<$options> hashref applies to all the values, and may contain the
+C<exp>, C<format>, C<persist_to> and C<replicate_to> keys. The C<format> must
+be one of the numeric C<COUCHBASE_FMT_*> constants. The returned documents
+contain the status and CAS of each item, but not the value.
+
+
+=head3 transform_multi(\@ids, $code)
+
+Atomically modify many documents. All the documents are retrieved, and
+C<$code> is called for each of them with a reference to its value and the
+document itself. If it returns true the document is replaced using its CAS.
+Documents which were modified concurrently are fetched again and passed to
+C<$code> once more, until they all succeed or the C<operation_timeout>
+elapses. Since C<$code> may be invoked more than once for a document, it
+should not have side effects.
+
+    my $res = $cb->transform_multi(\@ids, sub {
+        my ($vref, $doc) = @_;
+        $$vref->{count}++;
+        return 1;
+    });
+
+Returns a hashref of C<< id => Couchbase::Document >>, reflecting the last
+operation performed on each document.
+
 
 =head2 Batched Durability Requirements
 
@@ -36,6 +36,12 @@ A 'temporary' failure has ocurred. This usually means that the server which was
 the source or target of the operation (for example, a key store) was unreachable
 or unresponsive.
 
+=item EBUSY
+
+The operation was not performed because the server was too busy. This is also
+returned without contacting the server when an async bucket has reached its
+in-flight limits (see L<Couchbase::Bucket/"In-Flight Limits">).
+
 =item KEY_EEXISTS
 
 An operation which required the key not to already exist was attempted, but the
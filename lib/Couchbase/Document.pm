@@ -9,14 +9,16 @@ use Class::XSAccessor::Array accessors => {
     id => RETIDX_KEY,
     expiry => RETIDX_EXP,
     _cas => RETIDX_CAS,
-    value => RETIDX_VALUE,
     errnum => RETIDX_ERRNUM,
+    mutation_token => RETIDX_TOKEN,
 };
 
+# value() is implemented in XS, as it decodes values fetched with lazy_decode
+
 # Add additional includes later to avoid warnings on older versions
 use Couchbase::Constants;
 use base qw(Exporter);
-our @EXPORT = (qw(COUCHBASE_FMT_JSON COUCHBASE_FMT_UTF8 COUCHBASE_FMT_RAW COUCHBASE_FMT_STORABLE));
+our @EXPORT = (qw(COUCHBASE_FMT_JSON COUCHBASE_FMT_UTF8 COUCHBASE_FMT_RAW COUCHBASE_FMT_STORABLE COUCHBASE_FMT_SEREAL));
 
 sub is_ok {
     my $num = $_[0]->[RETIDX_ERRNUM];
@@ -65,6 +67,7 @@ sub copy {
     bless my $cp = [@$self], 'Couchbase::Document';
 
     $cp->_cas(0);
+    $cp->mutation_token(undef);
     return $cp;
 }
 
@@ -72,6 +75,7 @@ our %FMT_STR2NUM = (
     utf8 => COUCHBASE_FMT_UTF8,
     raw => COUCHBASE_FMT_RAW,
     storable => COUCHBASE_FMT_STORABLE,
+    sereal => COUCHBASE_FMT_SEREAL,
     json => COUCHBASE_FMT_JSON
 );
 
@@ -79,6 +83,8 @@ our %FMT_NUM2STR = reverse(%FMT_STR2NUM);
 
 sub format {
     my ($self, $fmtspec) = @_;
+    # Until decoded, the format slot holds the item flags
+    $self->value if $self->[RETIDX_LAZY];
     if (scalar @_ == 1) {
         my ($fmt_s, $fmt_i) = (undef, $self->[RETIDX_FMTSPEC]);
         if (wantarray) {
@@ -178,6 +184,11 @@ be encoded according to the document's L<"format()"> property.
 When retrieving a document (via the C<get()> method of L<Couchbase::Bucket>), this
 field will be updated with the value stored on the server, if successful.
 
+If the bucket was created with the C<lazy_decode> option, the value is only
+decoded the first time it is read. Storing the document without reading or
+changing its value stores the original bytes and flags, without decoding and
+re-encoding them.
+
 
 =head3 format()
 
@@ -210,6 +221,14 @@ only for values which cannot be encoded as JSON. Do not use this format
 if you wish this value to be readable by non-Perl applications.
 
 
+=item C<COUCHBASE_FMT_SEREAL>, "sereal"
+
+Encodes the value using L<Sereal::Encoder>. Like C<storable>, this can store
+any Perl structure and is not readable by non-Perl applications, but it is
+considerably faster and produces smaller values. L<Sereal::Encoder> and
+L<Sereal::Decoder> must be installed for this format to be used.
+
+
 =item C<COUCHBASE_FMT_RAW>, "raw"
 
 Stores the item as is, and marks it as an opaque string of bytes.
@@ -239,6 +258,14 @@ value is only read from and never written to, and is used to determine
 the "Time to live" for the document. See L<Couchbase::Document/"touch($doc)">
 
 
+=head3 mutation_token()
+
+Returns the mutation token from the last successful mutation on the document,
+as an array reference of C<[$vbucket, $vbucket_uuid, $seqno]>. This is C<undef>
+if the server did not return a token. Tokens are used for C<seqno> based
+durability checks (see L<Couchbase::Bucket/"Durability Requirements">).
+
+
 =head2 ERROR CHECKING
 
 =head3 is_ok()
@@ -6,6 +6,8 @@ use Data::Dumper;
 
 our $AUTOLOAD;
 
+# Document operations (get, upsert, etc.) are XS methods of this class. Any
+# other bucket method is forwarded here, with the context as its last argument
 sub AUTOLOAD {
     my $meth = (split(/::/, $AUTOLOAD))[-1];
     my $self = $_[0];
@@ -70,8 +72,9 @@ operation as a method of the context object itself (rather than the bucket).
 Once all the operations have been scheduled, the results should be submitted
 to the cluster and waited for.
 
-Once all operations have been completed, the batch object is no longer valid
-and must be recreated using the C<batch()> method on L<Couchbase::Bucket>.
+Contexts are independent of each other, and several may have operations in
+flight at once. Once all of its operations have completed, a context may be
+used for further operations.
 
 =head2 METHODS
 
@@ -79,7 +82,8 @@ and must be recreated using the C<batch()> method on L<Couchbase::Bucket>.
 
 Waits for all the scheduled operations to complete. When this method returns,
 all documents passed to the operations will have completed and their contents
-will be updated with new data from the server.
+will be updated with new data from the server. Operations of other contexts may
+also complete while waiting, but this only waits for its own.
 
 
 =head3 wait_one()
@@ -89,4 +93,5 @@ to waiting for all the operations to complete. This allows your application to d
 with each response as it arrives, rather than waiting for them all to complete.
 
 This method returns the next document whose operation has been completed, and
-a false value when no more outstanding operations remain.
+a false value when no more outstanding operations remain. Documents which
+completed while another context was being waited for are returned first.
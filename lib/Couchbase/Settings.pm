@@ -154,10 +154,35 @@ Takes a subroutine reference which returns an encoded JSON string from a Perl ob
 This may be used if you wish to use an alternate JSON encoder. The function is passed
 a single argument, which is a reference (or simple scalar) to encode.
 
+By default this is C<undef>, and values are encoded by a built-in encoder which
+behaves like L<JSON::XS> with C<allow_nonref>. Setting this back to C<undef>
+restores the built-in encoder.
+
 
 =item C<json_decoder>
 
 Takes a subroutine reference which decodes JSON. It is passed a single argument which
 is the JSON encoded string to decode.
 
+As with C<json_encoder>, the default of C<undef> selects a built-in decoder,
+which builds the Perl structure directly from the received data. C<true> and
+C<false> are returned as the same boolean objects used by the JSON modules.
+
+
+=item C<custom_encoder>
+
+Takes a subroutine reference which replaces all other encoding. It is called as
+C<< $encoder->($doc, \$value, \$flags) >> and must modify C<$value> to hold the
+encoded string and C<$flags> to hold the item flags to store. The document's own
+value is not modified. If the encoder dies, the storage operation fails with
+its error.
+
+
+=item C<custom_decoder>
+
+Takes a subroutine reference which replaces all other decoding. It is called as
+C<< $decoder->($doc, \$value, \$flags) >> with the stored bytes and item flags,
+and must modify C<$value> in place to hold the decoded value. If the decoder dies,
+a warning is emitted and the stored bytes are returned as the value.
+
 =back
@@ -0,0 +1,190 @@
+package Couchbase::Test::Async;
+use strict;
+use warnings;
+use base qw(Couchbase::Test::Common);
+use Test::More;
+use Couchbase::Bucket;
+use Couchbase::Document;
+use Couchbase::Constants;
+use Time::HiRes ();
+use Class::XSAccessor {
+    accessors => [ qw(cbo loop) ]
+};
+
+sub setup_client :Test(startup)
+{
+    my $self = shift;
+    $self->mock_init();
+
+    if (!eval { require IO::Async::Loop; require Couchbase::IO::Adapter::IOAsync; 1 }) {
+        $self->SKIP_ALL("IO::Async is needed for the async tests");
+    }
+    $self->loop(IO::Async::Loop->new);
+    $self->cbo($self->make_async);
+}
+
+# Creates a bucket on the test's loop, and runs the loop until it is connected
+sub make_async {
+    my ($self, %options) = @_;
+    my $status;
+
+    my $cbo = Couchbase::Bucket->new({
+        %{$self->common_options}, %options,
+        io => Couchbase::IO::Adapter::IOAsync->new_adapter($self->loop),
+        on_connect => sub { $status = $_[1] }
+    });
+    $self->run_until(sub { defined $status });
+    if (!defined $status || $status != COUCHBASE_SUCCESS) {
+        die("Couldn't connect: " . ($status // "timed out"));
+    }
+    return $cbo;
+}
+
+# Runs the loop until $cond returns true, or for at most $timeout seconds.
+# Returns the last result of $cond
+sub run_until {
+    my ($self, $cond, $timeout) = @_;
+    my $end = Time::HiRes::time() + ($timeout || 5);
+    my $rv;
+
+    until (($rv = $cond->()) || Time::HiRes::time() >= $end) {
+        $self->loop->loop_once(0.01);
+    }
+    return $rv;
+}
+
+# Starts an upsert, collecting its document in @$done once it completes
+sub upsert_async {
+    my ($self, $doc, $done) = @_;
+    my $ctx = $self->cbo->upsert($doc) or return;
+    $ctx->set_callback(sub { push @$done, $_[0] });
+    return $ctx;
+}
+
+sub TA01_autobatch_max_ops :Test(no_plan) {
+    my $self = shift;
+    my $cbo = $self->cbo;
+    my @docs = map { Couchbase::Document->new("autobatch_ops_$_", $_) } (1..3);
+    my @done;
+
+    # The delay is long enough that only the operation count sends the batch
+    $cbo->autobatch_configure(3, 0, 10);
+    $self->upsert_async($_, \@done) for @docs[0..1];
+    $self->run_until(sub { @done }, 0.3);
+    is(scalar @done, 0, "Operations held below max_ops");
+
+    $self->upsert_async($docs[2], \@done);
+    ok($self->run_until(sub { @done == 3 }), "Batch sent once max_ops was reached");
+    is(scalar grep($_->is_ok, @docs), 3, "All operations succeeded");
+
+    $cbo->autobatch_configure(0);
+}
+
+sub TA02_autobatch_max_bytes :Test(no_plan) {
+    my $self = shift;
+    my $cbo = $self->cbo;
+    my @docs = map { Couchbase::Document->new("autobatch_bytes_$_", "x" x 10) } (1..2);
+    push @docs, Couchbase::Document->new("autobatch_bytes_3", "x" x 200);
+    my @done;
+
+    $cbo->autobatch_configure(1000, 100, 10);
+    $self->upsert_async($_, \@done) for @docs[0..1];
+    $self->run_until(sub { @done }, 0.3);
+    is(scalar @done, 0, "Operations held below max_bytes");
+
+    $self->upsert_async($docs[2], \@done);
+    ok($self->run_until(sub { @done == 3 }), "Batch sent once max_bytes was reached");
+    is(scalar grep($_->is_ok, @docs), 3, "All operations succeeded");
+
+    $cbo->autobatch_configure(0);
+}
+
+sub TA03_autobatch_timer :Test(no_plan) {
+    my $self = shift;
+    my $cbo = $self->cbo;
+    my @docs = map { Couchbase::Document->new("autobatch_timer_$_", $_) } (1..2);
+    my @done;
+
+    $cbo->autobatch_configure(1000, 0, 0.2);
+    my $begin = Time::HiRes::time();
+    $self->upsert_async($_, \@done) for @docs;
+    ok($self->run_until(sub { @done == 2 }), "Batch sent by the timer");
+    cmp_ok(Time::HiRes::time() - $begin, '>=', 0.15, "Batch held until max_delay");
+    is(scalar grep($_->is_ok, @docs), 2, "All operations succeeded");
+
+    $cbo->autobatch_configure(0);
+}
+
+sub TA04_inflight_max_ops :Test(no_plan) {
+    my $self = shift;
+    my $cbo = $self->cbo;
+    my @docs = map { Couchbase::Document->new("inflight_ops_$_", $_) } (1..3);
+    my ($ndrained, @done, @done_at_drain) = (0);
+
+    $cbo->inflight_configure(2, 0, sub { $ndrained++; @done_at_drain = @done });
+    my $rejected = $cbo->inflight_stats->{rejected};
+    ok($self->upsert_async($_, \@done), "Scheduled below the limit") for @docs[0..1];
+    is($cbo->inflight_stats->{ops}, 2, "Two operations in flight");
+
+    ok(!$self->upsert_async($docs[2], \@done), "Rejected at the limit");
+    is($docs[2]->errnum, COUCHBASE_EBUSY, "Rejected with EBUSY");
+    is($cbo->inflight_stats->{rejected}, $rejected + 1, "Rejection counted");
+    is($ndrained, 0, "Not drained before any response");
+
+    ok($self->run_until(sub { @done == 2 }), "Scheduled operations completed");
+    is($ndrained, 1, "on_drain called once");
+    is(scalar @done_at_drain, 1, "on_drain called as soon as an operation completed");
+
+    ok($self->upsert_async($docs[2], \@done), "Accepted after draining");
+    ok($self->run_until(sub { @done == 3 }), "Operation completed");
+    ok($docs[2]->is_ok, "Operation succeeded");
+    is($ndrained, 1, "on_drain not called without rejections");
+
+    $cbo->inflight_configure(0);
+}
+
+sub TA05_inflight_max_bytes :Test(no_plan) {
+    my $self = shift;
+    my $cbo = $self->cbo;
+    my $big = Couchbase::Document->new("inflight_bytes_1", "x" x 200);
+    my $small = Couchbase::Document->new("inflight_bytes_2", 1);
+    my ($ndrained, @done) = (0);
+
+    $cbo->inflight_configure(0, 100, sub { $ndrained++ });
+    ok($self->upsert_async($big, \@done), "Scheduled below the limit");
+    cmp_ok($cbo->inflight_stats->{bytes}, '>=', 200, "Bytes in flight counted");
+    ok(!$self->upsert_async($small, \@done), "Rejected over max_bytes");
+    is($small->errnum, COUCHBASE_EBUSY, "Rejected with EBUSY");
+
+    ok($self->run_until(sub { $ndrained }), "on_drain called");
+    is($cbo->inflight_stats->{bytes}, 0, "Bytes released");
+
+    $cbo->inflight_configure(0);
+}
+
+sub TA06_inflight_drain_dies :Test(no_plan) {
+    my $self = shift;
+    my $cbo = $self->cbo;
+    my @docs = map { Couchbase::Document->new("inflight_die_$_", $_) } (1..2);
+    my (@done, @warnings);
+    local $SIG{__WARN__} = sub { push @warnings, @_ };
+
+    $cbo->inflight_configure(1, 0, sub { die "drain failed\n" });
+    ok($self->upsert_async($docs[0], \@done), "Scheduled below the limit");
+    ok(!$self->upsert_async($docs[1], \@done), "Rejected at the limit");
+
+    ok($self->run_until(sub { @done == 1 }), "Operation completed");
+    ok(grep(/drain failed/, @warnings), "Exception from on_drain is a warning");
+    ok($self->upsert_async($docs[1], \@done), "Bucket still usable");
+    ok($self->run_until(sub { @done == 2 }), "Operation completed");
+
+    $cbo->inflight_configure(0);
+}
+
+sub TA07_deferred_decode :Test(no_plan) {
+    my $self = shift;
+    eval { $self->cbo->batch({ decode => 'deferred' }) };
+    like($@, qr/not available in async mode/, "Deferred decoding rejected");
+}
+
+1;
@@ -5,7 +5,11 @@ use base qw(Couchbase::Test::Common);
 use Test::More;
 use Couchbase::Constants;
 use Data::Dumper;
+use Time::HiRes ();
+use POSIX ();
+use Scalar::Util ();
 use Couchbase::Bucket;
+use Couchbase::Document;
 
 sub setup_client :Test(startup)
 {
@@ -193,6 +197,48 @@ EOF
        "Serializing/Deserializing UTF-8 characters (not bytes!) = FMT_UTF8");
 }
 
+sub T05_json_builtin :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+    my $settings = $o->settings;
+
+    ok(!defined $settings->{json_encoder}, "Built-in encoder is the default");
+
+    my $structure = {
+        string => "caf\x{e9} \x{263a}\n\"quoted\"",
+        int => -42,
+        float => 1.5,
+        big => 18446744073709551615,
+        nested => [ 1, [ 2, { three => undef } ], {} ],
+        bools => [ \1, \0 ],
+    };
+    my $doc = Couchbase::Document->new("json_builtin", $structure);
+    ok($o->upsert($doc), "Stored with built-in encoder");
+    ok($o->get($doc), "Fetched with built-in decoder");
+
+    my $got = $doc->value;
+    is($got->{string}, $structure->{string}, "Strings round trip");
+    is($got->{int}, -42, "Integers round trip");
+    is($got->{float}, 1.5, "Floats round trip");
+    is($got->{big}, "18446744073709551615", "Large integers round trip");
+    is_deeply($got->{nested}, $structure->{nested}, "Nested structures round trip");
+    ok($got->{bools}[0] && !$got->{bools}[1], "Booleans round trip");
+
+    # Values from a custom decoder
+    my $ncalls = 0;
+    $settings->{json_decoder} = sub { $ncalls++; Couchbase::JSON->new->allow_nonref->decode($_[0]) };
+    $o->get($doc);
+    is($ncalls, 1, "Custom decoder is used when set");
+    is($doc->value->{string}, $structure->{string}, "Custom decoder gives the same value");
+
+    $settings->{json_decoder} = undef;
+    $o->get($doc);
+    is($ncalls, 1, "Built-in decoder is restored");
+
+    eval { $o->upsert(Couchbase::Document->new("json_builtin", sub { 1 })) };
+    like($@, qr/Cannot encode/, "Unencodable values are rejected");
+}
+
 sub multi_ok {
     my ($rv, $msg, $expect) = @_;
     my @errs;
@@ -230,6 +276,86 @@ sub T06_multi :Test(no_plan) {
     multi_ok(\@docs, "Multi remove OK");
 }
 
+sub T06_multi_duplicates :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+    my $id = "multi_duplicate";
+
+    $o->upsert(Couchbase::Document->new($id, "value"));
+    my @docs = map { Couchbase::Document->new($id) } (1..5);
+    my $batch = $o->batch();
+    $batch->get($_) for @docs;
+    $batch->touch(Couchbase::Document->new($id), { exp => 300 });
+    $batch->wait_all();
+
+    multi_ok(\@docs, "Multiple gets on the same key OK");
+    is(scalar grep($_->value eq 'value', @docs), scalar @docs,
+       "Each document got the value");
+    $o->remove(Couchbase::Document->new($id));
+}
+
+sub T06_multi_native :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+    my @ids = map { "multi_native_$_" } (0..9);
+
+    $o->upsert(Couchbase::Document->new($_, $_)) for @ids;
+
+    my $res = $o->get_multi(\@ids);
+    is(scalar keys %$res, scalar @ids, "get_multi: Got all documents");
+    multi_ok([values %$res], "get_multi: All OK");
+    is(scalar grep($res->{$_}->value eq $_, @ids), scalar @ids,
+       "get_multi: Got expected values");
+
+    $res = $o->touch_multi(\@ids, { exp => 300 });
+    multi_ok([values %$res], "touch_multi OK");
+
+    $res = $o->remove_multi(\@ids);
+    multi_ok([values %$res], "remove_multi OK");
+
+    $res = $o->get_multi([@ids, @ids]);
+    is(scalar keys %$res, scalar @ids, "Duplicate IDs only returned once");
+    multi_ok([values %$res], "get_multi: ENOENT after remove", COUCHBASE_KEY_ENOENT);
+
+    $res = $o->counter_multi(\@ids, { initial => 10, delta => 5 });
+    multi_ok([values %$res], "counter_multi OK");
+    is($res->{$ids[0]}->value, 10, "counter_multi: Initial value");
+    $res = $o->counter_multi(\@ids, { delta => 5 });
+    is($res->{$ids[0]}->value, 15, "counter_multi: Incremented");
+    $o->remove_multi(\@ids);
+}
+
+sub T06_store_multi :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+    my %values = map { ("store_multi_$_" => { num => $_ }) } (0..9);
+    my @ids = keys %values;
+
+    $o->remove_multi(\@ids);
+    my $res = $o->insert_multi(\%values);
+    multi_ok([values %$res], "insert_multi (hash) OK");
+    ok($res->{$ids[0]}->_cas, "Have CAS");
+
+    $res = $o->insert_multi(\%values);
+    multi_ok([values %$res], "insert_multi fails on existing", COUCHBASE_KEY_EEXISTS);
+
+    $res = $o->get_multi(\@ids);
+    is(scalar grep($res->{$_}->value->{num} == $values{$_}->{num}, @ids),
+       scalar @ids, "Got back stored values");
+
+    $res = $o->replace_multi(\@ids, [ map { "v_$_" } @ids ],
+                             { format => COUCHBASE_FMT_UTF8 });
+    multi_ok([values %$res], "replace_multi (arrays) OK");
+
+    $res = $o->get_multi(\@ids);
+    is($res->{$ids[0]}->value, "v_$ids[0]", "Got back replaced value");
+    is($res->{$ids[0]}->format, COUCHBASE_FMT_UTF8, "Format is retained");
+
+    eval { $o->upsert_multi(\@ids, ['too', 'short']) };
+    ok($@, "Got error for mismatched arrays");
+    $o->remove_multi(\@ids);
+}
+
 sub T07_stats :Test(no_plan) {
     my $self = shift;
     my $o = $self->cbo;
@@ -379,6 +505,59 @@ sub T13_endure :Test(no_plan) {
     }
 }
 
+sub T13_endure_batched :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->cbo;
+
+    my @docs = map { Couchbase::Document->new("endure_batched_$_", "value") } (0..19);
+    my $dup = Couchbase::Document->new("endure_batched_0", "other");
+    my $plain = Couchbase::Document->new("endure_batched_plain", "value");
+
+    # Mix requirements, a key stored twice, and a store without durability
+    my $batch = $cb->batch();
+    foreach my $ii (0..$#docs) {
+        my $opts = $ii % 2
+            ? { persist_to => -1, replicate_to => -1 } : { persist_to => 1 };
+        $batch->upsert($docs[$ii], $opts);
+    }
+    $batch->upsert($dup, { persist_to => 1 });
+    $batch->upsert($plain);
+    $batch->wait_all;
+
+    foreach (@docs, $dup, $plain) {
+        ok($_->is_ok, "Durable store OK for " . $_->id) or diag($_->errstr);
+    }
+}
+
+sub T13_endure_seqno :Test(no_plan) {
+    my $self = shift;
+    my $cb = Couchbase::Bucket->new({
+        %{$self->common_options}, durability_mode => 'seqno' });
+
+    my $doc = Couchbase::Document->new("endure_seqno", "value");
+    $cb->upsert($doc);
+    ok($doc->is_ok, "Stored OK");
+
+    my $token = $doc->mutation_token;
+    if (!$token) {
+        diag("Server did not return a mutation token");
+        return;
+    }
+    is(scalar @$token, 3, "Token has vbucket, uuid and seqno");
+    ok($token->[2] > 0, "Token has a sequence number");
+
+    $cb->upsert($doc, { persist_to => -1, replicate_to => -1 });
+    ok($doc->is_ok, "Durable store by seqno OK") or diag($doc->errstr);
+    ok($doc->mutation_token->[2] > $token->[2], "Sequence number advanced");
+
+    my $batch = $cb->durability_batch({ persist_to => -1, replicate_to => -1 });
+    $batch->endure($doc);
+    $batch->wait_all;
+    ok($doc->is_ok, "Explicit durability check by seqno OK") or diag($doc->errstr);
+
+    ok(!$doc->copy->mutation_token, "Copy does not keep the token");
+}
+
 sub T14_utf8 :Test(no_plan) {
     use utf8;
     my $self = shift;
@@ -389,4 +568,744 @@ sub T14_utf8 :Test(no_plan) {
     $cb->get($doc);
     is($txt, $doc->value->{string});
 }
+
+sub T15_replica_read :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->cbo;
+    my $doc = Couchbase::Document->new("replica_key", { value => "replica" });
+    $cb->upsert($doc, { replicate_to => 1 });
+    ok($doc->is_ok, "Stored with replication");
+
+    foreach my $opts ({}, { strategy => 'first' }, { strategy => 'all' },
+                      { strategy => 'index', index => 0 }) {
+        my $rdoc = Couchbase::Document->new("replica_key");
+        my $strategy = $opts->{strategy} || 'default';
+        $cb->get_from_replica($rdoc, $opts);
+        ok($rdoc->is_ok, "Replica read OK ($strategy)");
+        is($rdoc->value->{value}, "replica", "Got value from replica ($strategy)");
+    }
+
+    my $rdoc = Couchbase::Document->new("replica_nonexist");
+    $cb->get_from_replica($rdoc, { strategy => 'all' });
+    ok($rdoc->is_not_found, "ENOENT from all replicas");
+
+    eval { $cb->get_from_replica($rdoc, { strategy => 'bogus' }) };
+    ok($@, "Got error for unknown strategy");
+}
+
+sub T17_subdoc :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->cbo;
+    my $doc = Couchbase::Document->new("subdoc_key", {
+        name => "Mark", tags => ["a"], address => { city => "Reno" }, visits => 1
+    });
+    $cb->upsert($doc);
+
+    $cb->lookup_in($doc, { spec => [
+        [ get => 'name' ], [ get => 'address' ], [ exists => 'tags' ]
+    ]});
+    ok($doc->is_ok, "lookup_in OK");
+    is($doc->value->{name}, "Mark", "Got path value");
+    is_deeply($doc->value->{address}, { city => "Reno" }, "Got object fragment");
+    ok($doc->value->{tags}, "Path exists");
+
+    $cb->mutate_in($doc, { spec => [
+        [ upsert => 'address.zip', '89501' ],
+        [ array_append => 'tags', 'b' ],
+        [ counter => 'visits', 2 ],
+        [ upsert => 'prefs.lang', 'en' ]
+    ], create_parents => 1 });
+    ok($doc->is_ok, "mutate_in OK");
+    is($doc->value->{visits}, 3, "Got counter result");
+
+    my $full = $cb->fetch("subdoc_key");
+    is($full->value->{address}->{zip}, '89501', "Upsert applied");
+    is_deeply($full->value->{tags}, ['a', 'b'], "Array append applied");
+    is($full->value->{prefs}->{lang}, 'en', "Parents created");
+
+    $doc->_cas(0xdeadbeef);
+    $cb->mutate_in($doc, { spec => [ [ remove => 'name' ] ] });
+    ok($doc->is_cas_mismatch, "CAS is checked");
+
+    eval { $cb->lookup_in($doc, { spec => [ [ upsert => 'name', 'x' ] ] }) };
+    ok($@, "Mutation not allowed in lookup_in");
+    $cb->remove($full);
+}
+
+sub T18_cache :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->make_cbo();
+    my $doc = Couchbase::Document->new("cache_key", { flag => 1 });
+    $cb->upsert($doc);
+
+    $cb->cache_configure(2, 60);
+    $cb->get($doc);
+    ok($doc->is_ok, "Initial get OK");
+    is($cb->cache_stats->{misses}, 1, "First get is a miss");
+
+    my $doc2 = Couchbase::Document->new("cache_key");
+    ok($cb->get($doc2), "Cached get OK");
+    is_deeply($doc2->value, { flag => 1 }, "Got value from cache");
+    is($doc2->_cas, $doc->_cas, "Got CAS from cache");
+    is($cb->cache_stats->{hits}, 1, "Got a hit");
+
+    # Each read gets its own copy, so editing one in place leaves the cache
+    $doc->value->{flag} = 99;
+    $doc2->value->{flag} = 98;
+    my $doc3 = Couchbase::Document->new("cache_key");
+    ok($cb->get($doc3), "Cached get after in-place edits");
+    is($doc3->value->{flag}, 1, "Cached value unaffected by in-place edits");
+
+    # Modifying the document should invalidate the entry
+    $doc->value({ flag => 2 });
+    $cb->upsert($doc);
+    $cb->get($doc2);
+    is($doc2->value->{flag}, 2, "Entry invalidated on upsert");
+
+    # Stale entries are revalidated by CAS
+    $cb->cache_configure(2, 0);
+    $cb->get($doc2);
+    is($doc2->value->{flag}, 2, "Revalidated value");
+    ok($cb->cache_stats->{revalidated} >= 1, "Revalidation counted");
+    $doc2->value->{flag} = 97;
+    $cb->get($doc3);
+    is($doc3->value->{flag}, 2, "Revalidated value unaffected by in-place edits");
+
+    $cb->cache_configure(2, 60);
+    $cb->upsert(Couchbase::Document->new("cache_key_$_", $_)) for (1..3);
+    $cb->get(Couchbase::Document->new("cache_key_$_")) for (1..3);
+    ok($cb->cache_stats->{evictions} > 0, "LRU entries evicted");
+    ok($cb->cache_stats->{items} <= 2, "Cache is bounded");
+
+    $cb->remove($doc);
+    $cb->get($doc2);
+    ok($doc2->is_not_found, "Entry invalidated on remove");
+    $cb->cache_configure(0);
+}
+
+sub T19_negative_cache :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->make_cbo();
+    my $doc = Couchbase::Document->new("negcache_key", "value");
+    $cb->remove($doc);
+
+    $cb->negative_cache_configure(100, 60);
+    ok(!$cb->get($doc), "First get fails");
+    ok($doc->is_not_found, "Got ENOENT");
+
+    $doc = Couchbase::Document->new("negcache_key", "value");
+    ok(!$cb->get($doc), "Second get fails");
+    ok($doc->is_not_found, "Got ENOENT from negative cache");
+    is($cb->cache_stats->{negative_hits}, 1, "Negative hit counted");
+
+    ok($cb->insert($doc), "Insert OK");
+    ok($cb->get($doc), "Get OK after insert");
+    is($doc->value, "value");
+
+    $cb->remove($doc);
+    $cb->negative_cache_configure(0, 0);
+    $cb->negative_cache_configure(100, 0.5);
+    $cb->get($doc);
+    sleep(1);
+    $cb->get($doc);
+    is($cb->cache_stats->{negative_hits}, 0, "Entry expired after TTL");
+    $cb->negative_cache_configure(0, 0);
+}
+
+sub T20_transform_multi :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->cbo;
+    my @ids = map { "transform_$_" } (0..9);
+    $cb->upsert_multi({ map { ($_ => { count => 0 }) } @ids });
+
+    my $ncalls = 0;
+    my $res = $cb->transform_multi(\@ids, sub {
+        my ($vref, $doc) = @_;
+        $ncalls++;
+
+        # Simulate a concurrent modification the first time around
+        if ($ncalls == 1) {
+            my $other = Couchbase::Document->new($doc->id, { count => 100 });
+            $cb->upsert($other);
+        }
+        $$vref->{count}++;
+        return 1;
+    });
+
+    multi_ok([values %$res], "transform_multi OK");
+    is($ncalls, scalar @ids + 1, "Only the modified document was retried");
+
+    $res = $cb->get_multi(\@ids);
+    is(scalar grep($_->value->{count} == 1, values %$res), scalar @ids - 1,
+       "Documents transformed once");
+    is(scalar grep($_->value->{count} == 101, values %$res), 1,
+       "Concurrently modified document was retried");
+
+    # A document which always conflicts is retried until the timeout
+    {
+        local $cb->settings->{operation_timeout} = 0.5;
+        my $begin = Time::HiRes::time();
+        $ncalls = 0;
+        $res = $cb->transform_multi([ $ids[0] ], sub {
+            my ($vref, $doc) = @_;
+            $ncalls++;
+            $cb->upsert(Couchbase::Document->new($doc->id, { count => 0 }));
+            return 1;
+        });
+        my $elapsed = Time::HiRes::time() - $begin;
+        cmp_ok($ncalls, '>', 2, "Retried more than once");
+        cmp_ok($elapsed, '>=', 0.4, "Retried until the timeout");
+        cmp_ok($elapsed, '<', 5, "Stopped after the timeout");
+    }
+
+    $cb->remove_multi(\@ids);
+}
+
+sub T16_hedged_get :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->cbo;
+    my @ids = map { "hedge_$_" } (0..9);
+    $cb->upsert(Couchbase::Document->new($_, $_), { replicate_to => 1 }) for @ids;
+
+    # A tiny threshold will usually race the replica read against the active
+    # node. Either way the documents must be completed exactly once.
+    my @docs = map { Couchbase::Document->new($_) } @ids;
+    my $batch = $cb->batch();
+    $batch->get($_, { hedge_after => 0.000001 }) for @docs;
+    $batch->wait_all();
+    multi_ok(\@docs, "Hedged gets OK");
+    is(scalar grep($_->value eq $_->id, @docs), scalar @docs, "Got values");
+
+    my $doc = Couchbase::Document->new("hedge_nonexist");
+    $cb->get($doc, { hedge_after => 0.000001 });
+    ok($doc->is_not_found, "Hedged get returns ENOENT");
+
+    # Ensure any discarded responses do not affect later operations
+    $doc = Couchbase::Document->new($ids[0]);
+    ok($cb->get($doc), "Plain get after hedged gets");
+    is($doc->value, $ids[0]);
+
+    eval { $cb->get($doc, { hedge_after => -1 }) };
+    ok($@, "Negative hedge_after is rejected");
+
+    my $mock = $self->mock;
+    if (!$mock) {
+        diag("Skipping stalled hedged get without the mock server");
+        return;
+    }
+
+    # Stall the cluster, so the replica read is certainly sent. The active
+    # read times out (at 1s) before the cluster is resumed (at 1.25s), which
+    # leaves the replica read (timing out at 1.5s) to complete the document
+    local $cb->settings->{operation_timeout} = 1;
+    my $before = $cb->hedge_stats;
+    my $pid = fork();
+    die "Couldn't fork: $!" unless defined $pid;
+    if (!$pid) {
+        Time::HiRes::sleep(1.25);
+        $mock->resume_process;
+        POSIX::_exit(0);
+    }
+    $mock->suspend_process;
+
+    $doc = Couchbase::Document->new($ids[1]);
+    my $rv = $cb->get($doc, { hedge_after => 0.5 });
+    waitpid($pid, 0);
+    ok($rv, "Hedged get completed while the active node was stalled");
+    is($doc->value, $ids[1], "Got the value from the replica");
+
+    my $after = $cb->hedge_stats;
+    is($after->{sent}, $before->{sent} + 1, "Replica read was sent");
+    is($after->{won}, $before->{won} + 1, "Replica read completed the get");
+}
+
+sub T21_compression :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->cbo;
+
+    eval { $cb->compression_configure('lz4', 64) };
+    if ($@) {
+        diag("Skipping compression tests: $@");
+        return;
+    }
+
+    my $value = { items => [ map { { id => $_, name => "item number $_" } } (1..200) ] };
+    my $doc = Couchbase::Document->new("compressed_doc", $value);
+    ok($cb->upsert($doc), "Stored compressed document");
+
+    # A client without compression enabled must still read it
+    my $plain = $self->make_cbo;
+    my $raw = Couchbase::Document->new("compressed_doc");
+    ok($plain->get($raw), "Read back from another client");
+    is_deeply($raw->value, $value, "Decompressed automatically");
+
+    my $small = Couchbase::Document->new("compressed_small", { a => 1 });
+    ok($cb->upsert($small), "Stored small document");
+    ok($cb->get($small), "Fetched small document");
+    is_deeply($small->value, { a => 1 }, "Small document is not affected");
+
+    my $text = Couchbase::Document->new("compressed_utf8", "x" x 1000, { format => 'utf8' });
+    ok($cb->upsert($text), "Stored utf8 document");
+    ok($cb->append_bytes($text, { fragment => "y" }), "utf8 values can still be appended");
+    $cb->get($text);
+    is($text->value, ("x" x 1000) . "y", "Appended value is intact");
+
+    $cb->compression_configure(undef);
+    ok($cb->get($doc), "Compressed document read with compression disabled");
+    is_deeply($doc->value, $value, "Got the same value");
+
+    eval { $cb->compression_configure('bogus') };
+    like($@, qr/Unknown compression method/, "Unknown method is rejected");
+
+    # Compression is in the common flags, so legacy flags written by other
+    # clients (e.g. 0x100 for a boolean) are not mistaken for it
+    $plain->settings->{custom_encoder} = sub { ${$_[2]} = 0x100 };
+    my $legacy = Couchbase::Document->new("compressed_legacy", "true", { format => 'raw' });
+    ok($plain->upsert($legacy), "Stored value with legacy flags");
+    {
+        my @warnings;
+        local $SIG{__WARN__} = sub { push @warnings, @_ };
+        $raw = Couchbase::Document->new("compressed_legacy");
+        ok($cb->get($raw), "Fetched value with legacy flags");
+        ok(!grep(/decompress/, @warnings), "Not treated as compressed");
+    }
+}
+
+sub T22_compression_dictionary :Test(no_plan) {
+    my $self = shift;
+    my $cb = $self->cbo;
+
+    eval { $cb->compression_configure('zstd', 0) };
+    if ($@) {
+        diag("Skipping zstd tests: $@");
+        return;
+    }
+    $cb->compression_configure(undef);
+
+    my @ids;
+    foreach my $i (1..500) {
+        my $doc = Couchbase::Document->new("zsession:$i", {
+            user => "user$i", email => "user$i\@example.com",
+            created => 1400000000 + $i, roles => [qw(reader writer)] });
+        $cb->upsert($doc);
+        push @ids, $doc->id;
+    }
+
+    my $dict = $cb->compression_train(\@ids, { size => 4096 });
+    ok(length($dict) > 0 && length($dict) <= 4096, "Trained dictionary");
+
+    eval { $cb->compression_configure('zstd', 0, 7) };
+    like($@, qr/has not been added/, "Can't use a dictionary before adding it");
+    eval { $cb->compression_add_dictionary(70000, $dict) };
+    ok($@, "Dictionary IDs are limited to 16 bits");
+
+    $cb->compression_add_dictionary(7, $dict);
+    $cb->compression_configure('zstd', 0, 7);
+
+    my $value = { user => "someone", email => "someone\@example.com",
+        created => 1400000000, roles => [qw(reader)] };
+    my $doc = Couchbase::Document->new("zsession:new", $value);
+    ok($cb->upsert($doc), "Stored with dictionary");
+    ok($cb->get($doc), "Fetched with dictionary");
+    is_deeply($doc->value, $value, "Value round trips");
+
+    # Readers need the same dictionary
+    my $other = $self->make_cbo;
+    my $odoc = Couchbase::Document->new($doc->id);
+    {
+        my @warnings;
+        local $SIG{__WARN__} = sub { push @warnings, @_ };
+        $other->get($odoc);
+        like($warnings[0], qr/Couldn't decompress/, "Warned without dictionary");
+    }
+    $other->compression_add_dictionary(7, $dict);
+    ok($other->get($odoc), "Fetched with dictionary on another client");
+    is_deeply($odoc->value, $value, "Got the same value");
+
+    $cb->compression_configure(undef);
+}
+
+sub T23_lazy_decode :Test(no_plan) {
+    my $self = shift;
+    my $cb = Couchbase::Bucket->new({ %{$self->common_options}, lazy_decode => 1 });
+
+    my $value = { name => "lazy", list => [1..10] };
+    ok($cb->upsert(Couchbase::Document->new("lazy_doc", $value)), "Stored document");
+
+    my $ncalls = 0;
+    $cb->settings->{json_decoder} = sub { $ncalls++; Couchbase::JSON->new->decode($_[0]) };
+
+    my $doc = Couchbase::Document->new("lazy_doc");
+    ok($cb->get($doc), "Fetched document");
+    ok(length($doc->_cas), "Have CAS without decoding");
+    is($ncalls, 0, "Value was not decoded");
+
+    is_deeply($doc->value, $value, "Value decoded on access");
+    is($ncalls, 1, "Decoded once");
+    $doc->value;
+    is($ncalls, 1, "Not decoded again");
+    is($doc->format, COUCHBASE_FMT_JSON, "Format is available after decoding");
+
+    # Forwarding a document without looking at it stores the same bytes
+    $cb->get($doc);
+    my $copy = $doc->copy;
+    $copy->id("lazy_doc_copy");
+    ok($cb->upsert($copy), "Stored undecoded value");
+    is($ncalls, 1, "Storing did not decode");
+    my $check = Couchbase::Document->new("lazy_doc_copy");
+    $cb->get($check);
+    is_deeply($check->value, $value, "Stored value is intact");
+
+    # Setting the value discards the pending one
+    $cb->get($doc);
+    $doc->value({ replaced => 1 });
+    is_deeply($doc->value, { replaced => 1 }, "Setting a value discards the raw value");
+    is($ncalls, 2, "Replaced value was not decoded");
+
+    my $missing = Couchbase::Document->new("lazy_doc_missing");
+    $cb->remove($missing);
+    $cb->get($missing);
+    ok($missing->is_not_found, "Missing documents are unaffected");
+}
+
+sub T24_sereal :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+
+    if (!eval { require Sereal::Encoder; require Sereal::Decoder; 1 }) {
+        diag("Skipping Sereal tests: Sereal is not installed");
+        return;
+    }
+
+    my $structure = { list => [ 1..5 ], nested => { undef => undef, num => 1.5 },
+        blessed => bless({ a => 1 }, 'Couchbase::Test::SerealObj') };
+    my $doc = Couchbase::Document->new("sereal_doc", $structure, { format => 'sereal' });
+    ok($o->upsert($doc), "Stored as Sereal");
+
+    my $got = Couchbase::Document->new("sereal_doc");
+    ok($o->get($got), "Fetched Sereal document");
+    is_deeply($got->value, $structure, "Structure round trips");
+    is(ref $got->value->{blessed}, 'Couchbase::Test::SerealObj', "Objects keep their class");
+    is($got->format, COUCHBASE_FMT_SEREAL, "Format is detected as Sereal");
+    is(scalar $got->format, $doc->format, "Same format as stored");
+
+    # Storable values are still told apart
+    $doc->format('storable');
+    $o->upsert($doc);
+    $o->get($got);
+    is($got->format, COUCHBASE_FMT_STORABLE, "Storable is still detected");
+    is_deeply($got->value, $structure, "Storable value round trips");
+}
+
+sub T25_deferred_decode :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+
+    my @docs = map { Couchbase::Document->new("deferred_$_", { num => $_ }) } (1..20);
+    my $rawdoc = Couchbase::Document->new("deferred_raw", "raw value", { format => 'raw' });
+    $o->upsert($_) for (@docs, $rawdoc);
+    my @fetched = map { Couchbase::Document->new($_->id) } (@docs, $rawdoc);
+
+    my ($ncalls, $nstrings) = (0, 0);
+    my $ctx = $o->batch({
+        decode => 'deferred',
+        decode_many => sub {
+            $ncalls++;
+            $nstrings += @{$_[0]};
+            return [ map { Couchbase::JSON->new->decode($_) } @{$_[0]} ];
+        }
+    });
+    $ctx->get($_) for @fetched;
+    $ctx->wait_all;
+
+    is($ncalls, 1, "decode_many called once");
+    is($nstrings, 20, "All JSON values passed together");
+    is_deeply([ map { $_->value } @fetched[0..19] ], [ map { $_->value } @docs ],
+        "Values decoded");
+    is($fetched[20]->value, "raw value", "Other formats decoded individually");
+
+    # The context may be reused once waited for
+    @fetched = map { Couchbase::Document->new($_->id) } @docs;
+    $ctx->get($_) for @fetched;
+    $ctx->wait_all;
+    is($ncalls, 2, "decode_many called again for the reused context");
+    is_deeply([ map { $_->value } @fetched ], [ map { $_->value } @docs ],
+        "Values decoded in the reused context");
+
+    # Without decode_many the values are decoded natively
+    @fetched = map { Couchbase::Document->new($_->id) } @docs;
+    $ctx = $o->batch({ decode => 'deferred' });
+    $ctx->get($_) for @fetched;
+    $ctx->wait_all;
+    is_deeply($fetched[5]->value, { num => 6 }, "Deferred native decoding");
+
+    # Still deferred with the read cache enabled, which is filled as usual
+    $o->cache_configure(100, 60);
+    @fetched = map { Couchbase::Document->new($_->id) } @docs;
+    $ctx = $o->batch({ decode => 'deferred', decode_many => sub {
+        $ncalls++;
+        return [ map { Couchbase::JSON->new->decode($_) } @{$_[0]} ];
+    } });
+    $ctx->get($_) for @fetched;
+    $ctx->wait_all;
+    is($ncalls, 3, "decode_many called with the cache enabled");
+    is_deeply($fetched[5]->value, { num => 6 }, "Values decoded with the cache enabled");
+    my $cached = Couchbase::Document->new($docs[5]->id);
+    ok($o->get($cached), "Read back through the cache");
+    is($o->cache_stats->{hits}, 1, "Deferred reads filled the cache");
+    is_deeply($cached->value, { num => 6 }, "Cached value decoded");
+    $o->cache_configure(0);
+
+    eval { $o->batch({ decode => 'later' }) };
+    like($@, qr/decode must be/, "Invalid decode mode rejected");
+}
+
+sub T26_custom_converters :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+    my $settings = $o->settings;
+
+    my ($nenc, $ndec, $seen_flags) = (0, 0);
+    $settings->{custom_encoder} = sub {
+        my ($doc, $value, $flags) = @_;
+        $nenc++;
+        $$value = "custom:$$value";
+        $$flags = 0x42;
+    };
+    $settings->{custom_decoder} = sub {
+        my ($doc, $value, $flags) = @_;
+        $ndec++;
+        $seen_flags = $$flags;
+        $$value =~ s/^custom://;
+    };
+
+    my $doc = Couchbase::Document->new("custom_conv", "hello", { format => 'raw' });
+    ok($o->upsert($doc), "Stored with custom encoder");
+    is($doc->value, "hello", "Encoder does not modify the document's value");
+
+    for (1..3) {
+        ok($o->get($doc), "Fetched with custom decoder");
+    }
+    is($nenc, 1, "Encoder called once");
+    is($ndec, 3, "Decoder called for each fetch");
+    is($seen_flags, 0x42, "Decoder receives the flags set by the encoder");
+    is($doc->value, "hello", "Value decoded");
+
+    # A failing decoder leaves the raw value and warns
+    $settings->{custom_decoder} = sub { die "bad data" };
+    my @warnings;
+    {
+        local $SIG{__WARN__} = sub { push @warnings, @_ };
+        ok($o->get($doc), "Fetch succeeds even if the decoder fails");
+    }
+    is($doc->value, "custom:hello", "Raw value returned on decoder failure");
+    ok(grep(/bad data/, @warnings), "Decoder failure is reported");
+
+    # A failing encoder fails the operation
+    $settings->{custom_encoder} = sub { die "cannot encode" };
+    $doc->value("other");
+    eval { $o->upsert($doc) };
+    like($@, qr/cannot encode/, "Encoder failure is an error");
+    is($doc->value, "other", "Value is unchanged");
+
+    $settings->{custom_encoder} = undef;
+    $settings->{custom_decoder} = undef;
+}
+
+sub T27_strict_utf8 :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+    my $cb = Couchbase::Bucket->new({ %{$self->common_options}, strict_utf8 => 1 });
+
+    # Store malformed values by overriding the flags
+    my %bad = (
+        strict_utf8_text => [ "caf\xC3", COUCHBASE_FMT_UTF8 ],
+        strict_utf8_json => [ "\"\xED\xA0\x80\"", COUCHBASE_FMT_JSON ],
+    );
+    {
+        local $o->settings->{custom_encoder} = sub {
+            my ($doc, $value, $flags) = @_;
+            ($$value, $$flags) = @{ $bad{$doc->id} };
+        };
+        $o->upsert(Couchbase::Document->new($_, "")) for keys %bad;
+    }
+
+    for my $id (sort keys %bad) {
+        my $doc = Couchbase::Document->new($id);
+        my @warnings;
+        {
+            local $SIG{__WARN__} = sub { push @warnings, @_ };
+            ok($cb->get($doc), "Fetched $id");
+        }
+        ok(grep(/invalid UTF-8/, @warnings), "Invalid UTF-8 reported for $id");
+        is($doc->value, $bad{$id}[0], "Raw bytes returned for $id");
+        ok(!utf8::is_utf8($doc->value), "Value is not flagged as characters");
+    }
+
+    my $text = "caf\x{e9} \x{263a} " x 20;
+    my $doc = Couchbase::Document->new("strict_utf8_ok", $text, { format => 'utf8' });
+    ok($cb->upsert($doc), "Valid text stored");
+    ok($cb->get($doc), "Valid text fetched");
+    is($doc->value, $text, "Valid text round trips");
+
+    $doc->value("plain ascii");
+    ok($cb->upsert($doc), "ASCII stored");
+    ok(!utf8::is_utf8($doc->value), "ASCII is not upgraded");
+
+    {
+        no warnings 'utf8';
+        $doc->value("\x{D800}");
+    }
+    eval { $cb->upsert($doc) };
+    like($@, qr/not valid UTF-8/, "Surrogates are rejected");
+}
+
+sub T28_shared_encoding :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+
+    my $template = { type => "shared_encoding", list => [ 1, 2, 3 ] };
+    my @ids = map { "shared_encoding_$_" } (1..20);
+    my $before = $o->cache_stats;
+    my $rv = $o->upsert_multi({ map { ($_ => $template) } @ids });
+    multi_ok([ values %$rv ], "Stored template to many IDs");
+
+    my $stats = $o->cache_stats;
+    is($stats->{encode_misses} - $before->{encode_misses}, 1, "Template encoded once");
+    is($stats->{encode_hits} - $before->{encode_hits}, 19, "Encoding reused for the other IDs");
+
+    $rv = $o->get_multi(\@ids);
+    is_deeply($rv->{$ids[-1]}->value, $template, "Stored values are correct");
+
+    # Nothing is remembered across calls
+    $template->{type} = "shared_ENCODING";
+    $rv = $o->upsert_multi({ map { ($_ => $template) } @ids[0..1] });
+    multi_ok([ values %$rv ], "Stored modified template");
+    $rv = $o->get_multi([ @ids[0..1] ]);
+    is($rv->{$ids[1]}->value->{type}, "shared_ENCODING", "Modified structure re-encoded");
+    is($o->cache_stats->{encode_misses} - $stats->{encode_misses}, 1,
+       "Encoded again for the second call");
+
+    # An encoder which dies mid-call leaves nothing behind
+    my $ncalls = 0;
+    {
+        local $o->settings->{json_encoder} = sub {
+            die "cannot encode" if ++$ncalls == 2;
+            return '{"encoded":1}';
+        };
+        my $other = { type => "other" };
+        eval { $o->upsert_multi([ @ids[0..2] ], [ $template, $other, $template ]) };
+        like($@, qr/cannot encode/, "Exception from the encoder propagated");
+    }
+    $rv = $o->upsert_multi({ map { ($_ => $template) } @ids[0..1] });
+    multi_ok([ values %$rv ], "Stored after a failed call");
+    $rv = $o->get_multi([ @ids[0..1] ]);
+    is($rv->{$ids[0]}->value->{type}, "shared_ENCODING", "Not encoded by the failed call");
+}
+
+sub T29_autobatch_sync :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+
+    eval { $o->autobatch_configure(32) };
+    like($@, qr/only available in async mode/, "Auto-batching rejected for sync buckets");
+    ok($o->upsert(Couchbase::Document->new("autobatch_sync", 1)), "Operations unaffected");
+}
+
+sub T30_inflight_sync :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+
+    eval { $o->inflight_configure(32) };
+    like($@, qr/only available in async mode/, "In-flight limits rejected for sync buckets");
+    ok($o->upsert(Couchbase::Document->new("inflight_sync", 1)), "Operations unaffected");
+    my $stats = $o->inflight_stats;
+    is($stats->{ops}, 0, "No operations left in flight");
+    is($stats->{bytes}, 0, "No bytes left in flight");
+    is($stats->{rejected}, 0, "Nothing rejected");
+}
+
+sub T31_concurrent_batches :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+    my @wdocs = map { Couchbase::Document->new("concurrent_w_$_", { n => $_ }) } (0..9);
+    my @rdocs = map { Couchbase::Document->new("concurrent_r_$_", $_) } (0..9);
+
+    ok($o->upsert($_), "Stored " . $_->id) for @rdocs;
+
+    my $writes = $o->batch;
+    $writes->upsert($_) for @wdocs;
+    my $reads = $o->batch;
+    my @got = map { Couchbase::Document->new($_->id) } @rdocs;
+    $reads->get($_) for @got;
+
+    # Operations outside the batches are unaffected
+    my $single = Couchbase::Document->new("concurrent_r_0");
+    ok($o->get($single), "Single operation while batches are open");
+    is($single->value, 0, "Got value");
+
+    $reads->wait_all;
+    is($got[$_]->value, $_, "Read completed") for (0..9);
+
+    # Writes which completed while waiting for the reads are still
+    # returned by wait_one
+    my $n = 0;
+    while ((my $doc = $writes->wait_one)) {
+        ok($doc->is_ok, "Got " . $doc->id);
+        $n++;
+    }
+    is($n, scalar @wdocs, "All documents returned by wait_one");
+    $writes->wait_all;
+
+    # Contexts may be reused once complete
+    $writes->get($_) for @wdocs;
+    $writes->wait_all;
+    is($wdocs[$_]->value->{n}, $_, "Reused context") for (0..9);
+}
+
+sub T32_opcontext_methods :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+
+    foreach my $meth (qw(get get_and_touch get_and_lock touch upsert insert replace
+            append_bytes prepend_bytes remove get_from_replica lookup_in mutate_in
+            unlock counter endure)) {
+        ok(Couchbase::OpContext->can($meth), "$meth is an OpContext method");
+    }
+
+    my $doc = Couchbase::Document->new("opctx_methods", { v => 1 });
+    my $batch = $o->batch;
+    ok($batch->upsert($doc, { exp => 300 }), "Scheduled with options");
+    $batch->wait_all;
+    ok($doc->is_ok, "Stored");
+
+    eval { $batch->get("opctx_methods") };
+    like($@, qr/Must pass a Couchbase::Document/, "Document is checked");
+}
+
+sub T33_batch_croak_no_leak :Test(no_plan) {
+    my $self = shift;
+    my $o = $self->cbo;
+
+    my $batch = $o->batch;
+    my $weak = $batch;
+    Scalar::Util::weaken($weak);
+    eval { $batch->upsert(Couchbase::Document->new("batch_croak", sub { 1 })) };
+    like($@, qr/Cannot encode/, "Unencodable value croaks");
+    undef $batch;
+    ok(!defined $weak, "Batch freed after the operation croaked");
+
+    # A batch used after a croak is released once its operations complete
+    $batch = $o->batch;
+    $weak = $batch;
+    Scalar::Util::weaken($weak);
+    eval { $batch->upsert(Couchbase::Document->new("batch_croak", sub { 1 })) };
+    my $doc = Couchbase::Document->new("batch_croak", { v => 1 });
+    ok($batch->upsert($doc), "Scheduled after the croak");
+    $batch->wait_all;
+    ok($doc->is_ok, "Stored");
+    undef $batch;
+    ok(!defined $weak, "Batch freed once complete");
+}
+
 1;
@@ -29,8 +29,10 @@ Couchbase::Test::Common->Initialize(
 use Couchbase::Test::ClientSync;
 use Couchbase::Test::Settings;
 use Couchbase::Test::Views;
+use Couchbase::Test::Async;
 
 Couchbase::Test::ClientSync->runtests();
 Couchbase::Test::Settings->runtests();
 Couchbase::Test::Views->runtests();
+Couchbase::Test::Async->runtests();
 #Test::Class->runtests();
@@ -7,7 +7,16 @@ static int PLCB_connect(PLCB_t* self);
 void plcb_cleanup(PLCB_t *object)
 {
     plcb_opctx_clear(object);
+    if (object->autobatch.timer) {
+        lcb_timer_destroy(object->instance, object->autobatch.timer);
+        object->autobatch.timer = NULL;
+    }
+    SvREFCNT_dec(object->inflight.on_drain);
+    object->inflight.on_drain = NULL;
     SvREFCNT_dec(object->cachectx);
+    plcb_cache_destroy(object);
+    plcb_negcache_destroy(object);
+    plcb_compress_destroy(object);
 
     if (object->instance) {
         lcb_destroy(object->instance);
@@ -18,6 +27,10 @@ void plcb_cleanup(PLCB_t *object)
     _free_cv(cv_serialize); _free_cv(cv_deserialize);
     _free_cv(cv_jsonenc); _free_cv(cv_jsondec);
     _free_cv(cv_customenc); _free_cv(cv_customdec);
+    _free_cv(sereal_enc); _free_cv(sereal_dec);
+    _free_cv(sereal_enc_cv); _free_cv(sereal_dec_cv);
+    _free_cv(convargs.docrv); _free_cv(convargs.valrv);
+    _free_cv(convargs.flagsrv);
     #undef _free_cv
 }
 
@@ -32,6 +45,11 @@ PLCB_construct(const char *pkg, HV *hvopts)
     SV *blessed_obj;
     SV *iops_impl = NULL;
     SV *conncb = NULL;
+    const char *durmode = NULL;
+    int durmode_num = LCB_DURABILITY_MODE_DEFAULT;
+    int fetch_tokens = 1;
+    int lazy_decode = 0;
+    int strict_utf8 = 0;
 
     PLCB_t *object;
     plcb_OPTION options[] = {
@@ -39,12 +57,23 @@ PLCB_construct(const char *pkg, HV *hvopts)
         PLCB_KWARG("password", CSTRING, &cr_opts.v.v3.passwd),
         PLCB_KWARG("io", SV, &iops_impl),
         PLCB_KWARG("on_connect", CV, &conncb),
+        PLCB_KWARG(PLCB_ARG_K_DURMODE, CSTRING, &durmode),
+        PLCB_KWARG(PLCB_ARG_K_LAZYDECODE, BOOL, &lazy_decode),
+        PLCB_KWARG(PLCB_ARG_K_STRICTUTF8, BOOL, &strict_utf8),
         { NULL }
     };
 
     cr_opts.version = 3;
     plcb_extract_args((SV*)hvopts, options);
 
+    if (durmode == NULL || strcmp(durmode, "cas") == 0) {
+        durmode_num = LCB_DURABILITY_MODE_DEFAULT;
+    } else if (strcmp(durmode, "seqno") == 0) {
+        durmode_num = LCB_DURABILITY_MODE_SEQNO;
+    } else {
+        die("durability_mode must be 'cas' or 'seqno'");
+    }
+
     if (iops_impl && SvTYPE(iops_impl) != SVt_NULL) {
         plcb_IOPROCS *ioprocs;
         /* Validate */
@@ -67,6 +96,14 @@ PLCB_construct(const char *pkg, HV *hvopts)
     Newxz(object, 1, PLCB_t);
     lcb_set_cookie(instance, object);
     object->instance = instance;
+    object->durmode = durmode_num;
+    object->lazy_decode = lazy_decode;
+    object->strict_utf8 = strict_utf8;
+
+    /* Tokens are stored in each document after a mutation, and are needed
+     * for seqno based durability. Servers without support simply do not
+     * return them */
+    lcb_cntl(instance, LCB_CNTL_SET, LCB_CNTL_FETCH_MUTATION_TOKENS, &fetch_tokens);
 
     if (iops_impl) {
         object->ioprocs = newRV_inc(SvRV(iops_impl));
@@ -268,7 +305,7 @@ PLCB__codec_common(PLCB_t *object, int type, ...)
         SV *to_decref = *target;
 
         RETVAL = &PL_sv_undef;
-        if (tmpsv != &PL_sv_undef) {
+        if (SvOK(tmpsv)) {
             if (SvROK(tmpsv) == 0 || SvTYPE(SvRV(tmpsv)) != SVt_PVCV) {
                 die("Argument passed must be undef or CODE reference");
             }
@@ -282,6 +319,30 @@ PLCB__codec_common(PLCB_t *object, int type, ...)
     }
     OUTPUT: RETVAL
 
+void
+PLCB__sereal_init(PLCB_t *object, SV *encoder, SV *decoder)
+    PREINIT:
+    CV *enc_cv, *dec_cv;
+
+    CODE:
+    if (!sv_isobject(encoder) || !sv_isobject(decoder)) {
+        die("Must pass Sereal::Encoder and Sereal::Decoder objects");
+    }
+    /* Resolve the XS functions once, rather than looking up the methods
+     * for each value */
+    enc_cv = get_cv("Sereal::Encoder::encode", 0);
+    dec_cv = get_cv("Sereal::Decoder::decode", 0);
+    if (enc_cv == NULL || dec_cv == NULL) {
+        die("Sereal::Encoder and Sereal::Decoder must be loaded");
+    }
+
+    SvREFCNT_dec(object->sereal_enc); SvREFCNT_dec(object->sereal_dec);
+    SvREFCNT_dec(object->sereal_enc_cv); SvREFCNT_dec(object->sereal_dec_cv);
+    object->sereal_enc = newSVsv(encoder);
+    object->sereal_dec = newSVsv(decoder);
+    object->sereal_enc_cv = (CV *)SvREFCNT_inc(enc_cv);
+    object->sereal_dec_cv = (CV *)SvREFCNT_inc(dec_cv);
+
 void
 PLCB__cntl_set(PLCB_t *object, int setting, int type, SV *value)
 
@@ -309,7 +370,9 @@ PLCB__get(PLCB_t *self, SV *doc, ...)
     CODE:
     FILL_EXTRA_PARAMS()
 
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     RETVAL = PLCB_op_get(self, &opinfo);
     OUTPUT: RETVAL
     
@@ -329,7 +392,9 @@ PLCB__store(PLCB_t *self, SV *doc, ...)
     CODE:
     FILL_EXTRA_PARAMS()
     opinfo.cmdbase = ix;
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
 
     
     RETVAL = PLCB_op_set(self, &opinfo);
@@ -343,12 +408,46 @@ PLCB_remove(PLCB_t *self, SV *doc, ...)
 
     CODE:
     FILL_EXTRA_PARAMS()
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     
     RETVAL = PLCB_op_remove(self, &opinfo);
     OUTPUT: RETVAL
 
 
+SV *
+PLCB_get_from_replica(PLCB_t *self, SV *doc, ...)
+    PREINIT:
+    plcb_SINGLEOP opinfo = { PLCB_CMD_GETREPLICA };
+    dPLCB_INPUTS
+
+    CODE:
+    FILL_EXTRA_PARAMS()
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
+    RETVAL = PLCB_op_get_replica(self, &opinfo);
+    OUTPUT: RETVAL
+
+SV *
+PLCB__subdoc(PLCB_t *self, SV *doc, ...)
+    ALIAS:
+    lookup_in = PLCB_CMD_LOOKUP_IN
+    mutate_in = PLCB_CMD_MUTATE_IN
+
+    PREINIT:
+    plcb_SINGLEOP opinfo = { ix };
+    dPLCB_INPUTS
+
+    CODE:
+    FILL_EXTRA_PARAMS()
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
+    RETVAL = PLCB_op_subdoc(self, &opinfo);
+    OUTPUT: RETVAL
+
 SV *
 PLCB_unlock(PLCB_t *self, SV *doc, ...)
     PREINIT:
@@ -357,7 +456,9 @@ PLCB_unlock(PLCB_t *self, SV *doc, ...)
 
     CODE:
     FILL_EXTRA_PARAMS()
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     RETVAL = PLCB_op_unlock(self, &opinfo);
     OUTPUT: RETVAL
 
@@ -368,11 +469,57 @@ PLCB_counter(PLCB_t *self, SV *doc, ...)
     dPLCB_INPUTS;
     CODE:
     FILL_EXTRA_PARAMS()
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     RETVAL = PLCB_op_counter(self, &opinfo);
     OUTPUT: RETVAL
 
 
+SV *
+PLCB__multi(PLCB_t *self, SV *ids, ...)
+    ALIAS:
+    get_multi = PLCB_CMD_GET
+    get_and_touch_multi = PLCB_CMD_GAT
+    touch_multi = PLCB_CMD_TOUCH
+    remove_multi = PLCB_CMD_REMOVE
+    counter_multi = PLCB_CMD_COUNTER
+
+    PREINIT:
+    SV *options = &PL_sv_undef;
+
+    CODE:
+    if (items > 3) { croak_xs_usage(cv, "bucket, ids [, options ]"); }
+    if (items == 3) { options = ST(2); }
+    RETVAL = PLCB_op_multi(self, ix, ids, options);
+    OUTPUT: RETVAL
+
+SV *
+PLCB__store_multi(PLCB_t *self, SV *ids, ...)
+    ALIAS:
+    upsert_multi = PLCB_CMD_SET
+    insert_multi = PLCB_CMD_ADD
+    replace_multi = PLCB_CMD_REPLACE
+
+    PREINIT:
+    SV *values = &PL_sv_undef;
+    SV *options = &PL_sv_undef;
+
+    CODE:
+    if (SvROK(ids) && SvTYPE(SvRV(ids)) == SVt_PVHV) {
+        if (items > 3) { croak_xs_usage(cv, "bucket, \\%values [, options ]"); }
+        if (items == 3) { options = ST(2); }
+    } else {
+        if (items < 3 || items > 4) {
+            croak_xs_usage(cv, "bucket, \\@ids, \\@values [, options ]");
+        }
+        values = ST(2);
+        if (items == 4) { options = ST(3); }
+    }
+    RETVAL = PLCB_op_store_multi(self, ix, ids, values, options);
+    OUTPUT: RETVAL
+
+
 SV *
 PLCB_endure(PLCB_t *self, SV *doc, ...)
     PREINIT:
@@ -380,7 +527,9 @@ PLCB_endure(PLCB_t *self, SV *doc, ...)
     dPLCB_INPUTS;
     CODE:
     FILL_EXTRA_PARAMS()
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     RETVAL = PLCB_op_endure(self, &opinfo);
     OUTPUT: RETVAL
 
@@ -397,7 +546,9 @@ PLCB__stats_common(PLCB_t *self, SV *doc, ...)
 
     CODE:
     FILL_EXTRA_PARAMS()
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     RETVAL = PLCB_op_stats(self, &opinfo);
     OUTPUT: RETVAL
 
@@ -409,7 +560,9 @@ PLCB__observe(PLCB_t *self, SV *doc, ...)
     dPLCB_INPUTS
     CODE:
     FILL_EXTRA_PARAMS()
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     RETVAL = PLCB_op_observe(self, &opinfo);
     OUTPUT: RETVAL
 
@@ -420,7 +573,9 @@ PLCB__http(PLCB_t *self, SV *doc, ...)
     dPLCB_INPUTS
     CODE:
     FILL_EXTRA_PARAMS()
-    plcb_opctx_initop(&opinfo, self, doc, ctx, options);
+    if (!plcb_opctx_initop(&opinfo, self, doc, ctx, options)) {
+        XSRETURN_NO;
+    }
     RETVAL = PLCB_op_http(self, &opinfo);
     OUTPUT: RETVAL
 
@@ -479,13 +634,40 @@ PLCB_get_bucket_config(PLCB_t *object)
     OUTPUT: RETVAL
 
 SV *
-PLCB_batch(PLCB_t *object)
+PLCB_batch(PLCB_t *object, SV *options = NULL)
     PREINIT:
     SV *ctxrv = NULL;
+    plcb_OPCTX *ctx;
+    const char *decode = NULL;
+    SV *decode_many = NULL;
+    plcb_OPTION args[] = {
+        PLCB_KWARG(PLCB_ARG_K_DECODE, CSTRING, &decode),
+        PLCB_KWARG(PLCB_ARG_K_DECODEMANY, CV, &decode_many),
+        { NULL }
+    };
 
     CODE:
-    ctxrv = plcb_opctx_new(object, 0);
-    RETVAL = newRV_inc(SvRV(ctxrv));
+    if (options && SvOK(options)) {
+        plcb_extract_args(options, args);
+    }
+    if (decode && strcmp(decode, "deferred") != 0 && strcmp(decode, "immediate") != 0) {
+        die("decode must be 'immediate' or 'deferred'");
+    }
+    /* Deferred values are decoded by wait_all(), which async buckets don't use */
+    if (decode && strcmp(decode, "deferred") == 0 && object->async) {
+        die("Deferred decoding is not available in async mode");
+    }
+
+    RETVAL = ctxrv = plcb_opctx_new(object, 0);
+
+    if (decode && strcmp(decode, "deferred") == 0) {
+        ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(ctxrv)));
+        ctx->flags |= PLCB_OPCTXf_DEFERDECODE;
+        ctx->deferred = newAV();
+        if (decode_many) {
+            ctx->decode_many = newRV_inc(SvRV(decode_many));
+        }
+    }
 
     lcb_sched_enter(object->instance);
     OUTPUT: RETVAL
@@ -506,11 +688,11 @@ PLCB_durability_batch(PLCB_t *object, SV *options)
     };
     CODE:
     plcb_extract_args(options, args);
-    ctxrv = plcb_opctx_new(object, 0);
-    RETVAL = newRV_inc(SvRV(ctxrv));
+    RETVAL = ctxrv = plcb_opctx_new(object, 0);
     dopts.v.v0.persist_to = persist_to;
     dopts.v.v0.replicate_to = replicate_to;
     dopts.v.v0.check_delete = is_delete;
+    dopts.v.v0.pollopts = object->durmode;
     if (replicate_to == -1 || persist_to == -1) {
         dopts.v.v0.cap_max = 1;
     }
@@ -546,12 +728,135 @@ PLCB_user_data(PLCB_t *object, ...)
     SvREFCNT_inc(RETVAL);
     OUTPUT: RETVAL
 
+void
+PLCB_cache_configure(PLCB_t *object, UV max_items, NV max_age = 0)
+    CODE:
+    if (max_age < 0) {
+        die("max_age must not be negative");
+    }
+    plcb_cache_configure(object, max_items, max_age);
+
+void
+PLCB_cache_clear(PLCB_t *object)
+    CODE:
+    plcb_cache_clear(object);
+
+void
+PLCB_negative_cache_configure(PLCB_t *object, UV max_items, NV ttl)
+    CODE:
+    plcb_negcache_configure(object, max_items, ttl);
+
+void
+PLCB_autobatch_configure(PLCB_t *object, UV max_ops, UV max_bytes = 0, NV max_delay = 0.0005)
+    CODE:
+    if (!object->async) {
+        die("Auto-batching is only available in async mode");
+    }
+    if (max_delay < 0) {
+        die("max_delay must not be negative");
+    }
+    plcb_autobatch_configure(object, max_ops, max_bytes, (lcb_U32)(max_delay * 1000000));
+
+void
+PLCB_inflight_configure(PLCB_t *object, UV max_ops, UV max_bytes = 0, SV *on_drain = NULL)
+    CODE:
+    if (!object->async) {
+        die("In-flight limits are only available in async mode");
+    }
+    if (on_drain && SvOK(on_drain) &&
+            (!SvROK(on_drain) || SvTYPE(SvRV(on_drain)) != SVt_PVCV)) {
+        die("on_drain must be a CODE reference");
+    }
+    SvREFCNT_dec(object->inflight.on_drain);
+    object->inflight.on_drain = NULL;
+    if (on_drain && SvOK(on_drain)) {
+        object->inflight.on_drain = newSVsv(on_drain);
+    }
+    object->inflight.maxops = max_ops;
+    object->inflight.maxbytes = max_bytes;
+    object->inflight.rejecting = 0;
+
+HV *
+PLCB_inflight_stats(PLCB_t *object)
+    CODE:
+    RETVAL = newHV();
+    sv_2mortal((SV*)RETVAL);
+    (void)hv_stores(RETVAL, "ops", newSViv(object->npending));
+    (void)hv_stores(RETVAL, "bytes", newSVuv(object->inflight.nbytes));
+    (void)hv_stores(RETVAL, "max_ops", newSVuv(object->inflight.maxops));
+    (void)hv_stores(RETVAL, "max_bytes", newSVuv(object->inflight.maxbytes));
+    (void)hv_stores(RETVAL, "rejected", newSVuv(object->inflight.nrejected));
+    OUTPUT: RETVAL
+
+HV *
+PLCB_hedge_stats(PLCB_t *object)
+    CODE:
+    RETVAL = newHV();
+    sv_2mortal((SV*)RETVAL);
+    (void)hv_stores(RETVAL, "sent", newSVuv(object->nhedged));
+    (void)hv_stores(RETVAL, "won", newSVuv(object->nhedgewins));
+    OUTPUT: RETVAL
+
+void
+PLCB_compression_configure(PLCB_t *object, SV *method, UV min_size = 0, UV dict_id = 0)
+    CODE:
+    plcb_compress_configure(object, SvOK(method) ? SvPV_nolen(method) : NULL, min_size, dict_id);
+
+void
+PLCB_compression_add_dictionary(PLCB_t *object, UV id, SV *dict)
+    PREINIT:
+    const char *data;
+    STRLEN len;
+    CODE:
+    data = SvPVbyte(dict, len);
+    plcb_compress_add_dict(object, id, data, len);
+
+SV *
+PLCB__compression_train(PLCB_t *object, AV *samples, UV dict_size)
+    CODE:
+    RETVAL = plcb_compress_train(object, samples, dict_size);
+    OUTPUT: RETVAL
+
+HV *
+PLCB_cache_stats(PLCB_t *object)
+    CODE:
+    RETVAL = plcb_cache_stats(object);
+    sv_2mortal((SV*)RETVAL);
+    OUTPUT: RETVAL
+
 int
 PLCB_connected(PLCB_t *object)
     CODE:
     RETVAL = object->connected;
     OUTPUT: RETVAL
 
+MODULE = Couchbase PACKAGE = Couchbase::Document PREFIX = PLCB_doc_
+
+void
+PLCB_doc_value(SV *self, ...)
+    PREINIT:
+    AV *docav;
+    SV **tmp;
+
+    PPCODE:
+    if (!SvROK(self) || SvTYPE(SvRV(self)) != SVt_PVAV) {
+        die("Not a valid Couchbase::Document");
+    }
+    docav = (AV *)SvRV(self);
+
+    if (items > 1) {
+        /* Replacing the value discards any pending raw value */
+        plcb_doc_clear_lazy(docav);
+        av_store(docav, PLCB_RETIDX_VALUE, newSVsv(ST(1)));
+        ST(0) = ST(1);
+        XSRETURN(1);
+    }
+
+    plcb_doc_inflate(docav);
+    tmp = av_fetch(docav, PLCB_RETIDX_VALUE, 0);
+    ST(0) = tmp ? *tmp : &PL_sv_undef;
+    XSRETURN(1);
+
 MODULE = Couchbase PACKAGE = Couchbase::OpContext PREFIX = PLCB_ctx_
 
 void
@@ -564,17 +869,15 @@ PLCB_ctx_wait_all(plcb_OPCTX *ctx)
         die("Parent context is destroyed");
     }
 
-    if (!parent->curctx) {
-        die("Current context is not active");
-    }
-
-    if (!ctx->nremaining) {
-        return;
-    }
     /* Remove the 'wait_one' flag */
     ctx->flags &= ~PLCB_OPCTXf_WAITONE;
-    plcb_opctx_submit(parent, ctx);
-    lcb_wait3(parent->instance, LCB_WAIT_NOCHECK);
+    if (ctx->nremaining) {
+        plcb_opctx_wait(parent, ctx, 0);
+    }
+    if (ctx->u.ctxqueue) {
+        av_clear(ctx->u.ctxqueue);
+    }
+    plcb_opctx_decode_deferred(parent, ctx);
 
 
 SV *
@@ -605,13 +908,47 @@ PLCB_ctx_wait_one(plcb_OPCTX *ctx)
     }
 
     ctx->flags |= PLCB_OPCTXf_WAITONE;
-    plcb_opctx_submit(parent, ctx);
-    lcb_wait3(parent->instance, LCB_WAIT_NOCHECK);
+    plcb_opctx_wait(parent, ctx, 1);
     RETVAL = av_shift(ctx->u.ctxqueue);
 
     GT_DONE: ;
     OUTPUT: RETVAL
 
+SV *
+PLCB_ctx__op(plcb_OPCTX *ctx, SV *doc, SV *options = NULL)
+    ALIAS:
+    get = PLCB_CMD_GET
+    get_and_touch = PLCB_CMD_GAT
+    get_and_lock = PLCB_CMD_LOCK
+    touch = PLCB_CMD_TOUCH
+    upsert = PLCB_CMD_SET
+    insert = PLCB_CMD_ADD
+    replace = PLCB_CMD_REPLACE
+    append_bytes = PLCB_CMD_APPEND
+    prepend_bytes = PLCB_CMD_PREPEND
+    remove = PLCB_CMD_REMOVE
+    get_from_replica = PLCB_CMD_GETREPLICA
+    lookup_in = PLCB_CMD_LOOKUP_IN
+    mutate_in = PLCB_CMD_MUTATE_IN
+    unlock = PLCB_CMD_UNLOCK
+    counter = PLCB_CMD_COUNTER
+    endure = PLCB_CMD_ENDURE
+
+    PREINIT:
+    PLCB_t *parent;
+    plcb_SINGLEOP opinfo = { ix };
+
+    CODE:
+    (void)ctx;
+    if (!parent) {
+        die("Parent context is destroyed");
+    }
+    if (!plcb_opctx_initop(&opinfo, parent, doc, ST(0), options)) {
+        XSRETURN_NO;
+    }
+    RETVAL = PLCB_op_dispatch(parent, &opinfo);
+    OUTPUT: RETVAL
+
 SV *
 PLCB_ctx__cbo(plcb_OPCTX *ctx)
     PREINIT:
@@ -652,6 +989,11 @@ PLCB_ctx_DESTROY(plcb_OPCTX *ctx)
     SvREFCNT_dec(ctx->parent);
     SvREFCNT_dec(ctx->u.ctxqueue);
     SvREFCNT_dec(ctx->docs);
+    SvREFCNT_dec(ctx->deferred);
+    SvREFCNT_dec(ctx->decode_many);
+    plcb_opctx_release_slots(ctx);
+    plcb_opctx_release_durability(ctx);
+    Safefree(ctx->slots);
     Safefree(ctx);
 
 MODULE = Couchbase PACKAGE = Couchbase    PREFIX = PLCB_
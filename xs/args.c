@@ -214,7 +214,7 @@ load_doc_options(PLCB_t *parent, AV *ret, plcb_OPTION *values)
 }
 
 int
-PLCB_args_get(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDGET *gcmd)
+PLCB_args_get(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDGET *gcmd, lcb_U32 *hedge_us)
 {
     if (args->cmdbase == PLCB_CMD_LOCK) {
         UV lockexp;
@@ -241,6 +241,25 @@ PLCB_args_get(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDGET *gcmd)
         };
         load_doc_options(object, args->docav, doc_specs);
         ((lcb_CMDBASE*) gcmd)->exptime = exp;
+
+    } else if (args->cmdbase == PLCB_CMD_GET && args->cmdopts) {
+        SV *hedge = NULL;
+        plcb_OPTION opts_specs[] = {
+            PLCB_KWARG(PLCB_ARG_K_HEDGE, SV, &hedge),
+            {NULL}
+        };
+
+        plcb_extract_args(args->cmdopts, opts_specs);
+        if (hedge && SvOK(hedge)) {
+            NV secs = SvNV(hedge);
+            if (secs <= 0) {
+                die(PLCB_ARG_K_HEDGE " must be a positive number of seconds");
+            }
+            *hedge_us = secs * 1000000;
+            if (*hedge_us == 0) {
+                *hedge_us = 1;
+            }
+        }
     }
 
     return 0;
@@ -324,6 +343,182 @@ PLCB_args_observe(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDOBSERVE *cmd)
     return 0;
 }
 
+int
+PLCB_args_get_replica(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDGETREPLICA *rcmd)
+{
+    const char *strategy = NULL;
+    SV *index = NULL;
+    plcb_OPTION argspecs[] = {
+        PLCB_KWARG(PLCB_ARG_K_STRATEGY, CSTRING_NN, &strategy),
+        PLCB_KWARG(PLCB_ARG_K_INDEX, SV, &index),
+        {NULL}
+    };
+
+    if (args->cmdopts) {
+        plcb_extract_args(args->cmdopts, argspecs);
+    }
+
+    if (strategy == NULL) {
+        strategy = index ? "index" : "first";
+    }
+
+    if (strcmp(strategy, "first") == 0) {
+        rcmd->strategy = LCB_REPLICA_FIRST;
+    } else if (strcmp(strategy, "all") == 0) {
+        rcmd->strategy = LCB_REPLICA_ALL;
+    } else if (strcmp(strategy, "index") == 0) {
+        if (index == NULL || !SvOK(index) || SvIV(index) < 0) {
+            die("Replica strategy 'index' requires a non-negative " PLCB_ARG_K_INDEX);
+        }
+        rcmd->strategy = LCB_REPLICA_SELECT;
+        rcmd->index = SvIV(index);
+    } else {
+        die("Unknown replica strategy '%s'. Must be 'first', 'all' or 'index'", strategy);
+    }
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    lcb_U32 sdcmd;
+    int mutation;
+    int has_value;
+} subdoc_ops[] = {
+    { "get", LCB_SDCMD_GET, 0, 0 },
+    { "exists", LCB_SDCMD_EXISTS, 0, 0 },
+    { "replace", LCB_SDCMD_REPLACE, 1, 1 },
+    { "insert", LCB_SDCMD_DICT_ADD, 1, 1 },
+    { "upsert", LCB_SDCMD_DICT_UPSERT, 1, 1 },
+    { "array_prepend", LCB_SDCMD_ARRAY_ADD_FIRST, 1, 1 },
+    { "array_append", LCB_SDCMD_ARRAY_ADD_LAST, 1, 1 },
+    { "array_add_unique", LCB_SDCMD_ARRAY_ADD_UNIQUE, 1, 1 },
+    { "counter", LCB_SDCMD_COUNTER, 1, 1 },
+    { "remove", LCB_SDCMD_REMOVE, 1, 0 },
+    { NULL }
+};
+
+/* Parses the 'spec' option, which is a list of [ op, path, value ] entries.
+ * Values are always encoded as JSON. Returns the spec list */
+SV *
+PLCB_args_subdoc(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDSUBDOC *cmd)
+{
+    SV *specrv = NULL;
+    AV *specav;
+    lcb_SDSPEC *specs;
+    int mkparents = 0, ignore_cas = 0;
+    int is_mutate = args->cmdbase == PLCB_CMD_MUTATE_IN;
+    I32 ii, nspecs;
+    plcb_OPTION doc_specs[] = {
+        PLCB_KWARG(PLCB_ARG_K_CAS, CAS, &cmd->cas),
+        {NULL}
+    };
+    plcb_OPTION opts_specs[] = {
+        PLCB_KWARG(PLCB_ARG_K_SPEC, AV, &specrv),
+        PLCB_KWARG(PLCB_ARG_K_MKPARENTS, BOOL, &mkparents),
+        PLCB_KWARG(PLCB_ARG_K_IGNORECAS, BOOL, &ignore_cas),
+        {NULL}
+    };
+
+    if (args->cmdopts) {
+        plcb_extract_args(args->cmdopts, opts_specs);
+    }
+    if (!specrv) {
+        die("Must have '" PLCB_ARG_K_SPEC "' for sub-document operations");
+    }
+
+    if (is_mutate) {
+        load_doc_options(object, args->docav, doc_specs);
+        if (ignore_cas) {
+            cmd->cas = 0;
+        }
+    }
+
+    specav = (AV *)SvRV(specrv);
+    nspecs = av_len(specav) + 1;
+    if (nspecs < 1) {
+        die("Spec list must not be empty");
+    }
+
+    Newxz(specs, nspecs, lcb_SDSPEC);
+    SAVEFREEPV(specs);
+
+    for (ii = 0; ii < nspecs; ii++) {
+        SV **tmp = av_fetch(specav, ii, 0);
+        AV *cur;
+        SV **opsv, **pathsv, **valsv;
+        const char *opname, *path;
+        STRLEN npath;
+        int opix;
+
+        if (!tmp || !plcb_is_arrayref(*tmp)) {
+            die("Each spec must be an ARRAY reference of [ op, path, value ]");
+        }
+
+        cur = (AV *)SvRV(*tmp);
+        opsv = av_fetch(cur, 0, 0);
+        pathsv = av_fetch(cur, 1, 0);
+        valsv = av_fetch(cur, 2, 0);
+
+        if (!opsv || !SvOK(*opsv)) {
+            die("Spec must have an operation");
+        }
+        opname = SvPV_nolen(*opsv);
+        for (opix = 0; subdoc_ops[opix].name; opix++) {
+            if (strcmp(subdoc_ops[opix].name, opname) == 0) {
+                break;
+            }
+        }
+        if (subdoc_ops[opix].name == NULL) {
+            die("Unknown sub-document operation '%s'", opname);
+        }
+        if (subdoc_ops[opix].mutation != is_mutate) {
+            die("Operation '%s' cannot be used with %s", opname,
+                is_mutate ? "mutate_in" : "lookup_in");
+        }
+
+        if (pathsv == NULL || !SvOK(*pathsv)) {
+            path = "";
+            npath = 0;
+        } else {
+            path = SvPV(*pathsv, npath);
+        }
+        if (npath == 0 && subdoc_ops[opix].sdcmd != LCB_SDCMD_GET) {
+            die("Operation '%s' requires a path", opname);
+        }
+
+        specs[ii].sdcmd = subdoc_ops[opix].sdcmd;
+        LCB_SDSPEC_SET_PATH(&specs[ii], path, npath);
+        if (is_mutate && mkparents) {
+            specs[ii].options |= LCB_SDSPEC_F_MKINTERMEDIATES;
+        }
+
+        if (!subdoc_ops[opix].has_value) {
+            continue;
+        }
+        if (valsv == NULL || SvTYPE(*valsv) == SVt_NULL) {
+            die("Operation '%s' requires a value", opname);
+        }
+
+        if (specs[ii].sdcmd == LCB_SDCMD_COUNTER) {
+            SV *delta = sv_2mortal(newSVpvf("%" IVdf, SvIV(*valsv)));
+            LCB_SDSPEC_SET_VALUE(&specs[ii], SvPVX(delta), SvCUR(delta));
+        } else {
+            plcb_DOCVAL vspec = { 0 };
+            vspec.value = *valsv;
+            vspec.spec = PLCB_CF_JSON;
+            plcb_convert_storage_ex(object, args->docav, &vspec, PLCB_CONVERT_NOCUSTOM);
+            if (vspec.need_free) {
+                sv_2mortal(vspec.value);
+            }
+            LCB_SDSPEC_SET_VALUE(&specs[ii], vspec.encoded, vspec.len);
+        }
+    }
+
+    cmd->specs = specs;
+    cmd->nspecs = nspecs;
+    return newRV_inc((SV *)specav);
+}
+
 #define is_append(cmd) (cmd) == PLCB_CMD_APPEND || (cmd) == PLCB_CMD_PREPEND
 
 int
@@ -349,6 +544,8 @@ PLCB_args_set(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDSTORE *scmd, plcb_DOCV
     };
 
     if (is_append(args->cmdbase)) {
+        /* The format is checked below, so it must be the decoded one */
+        plcb_doc_inflate(args->docav);
         doc_specs[0].type = PLCB_ARG_T_PAD;
         vspec->spec = PLCB_CF_UTF8;
     } else {
@@ -419,3 +616,67 @@ PLCB_args_http(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDHTTP *htcmd)
     htcmd->method = ht_meth;
     return 0;
 }
+
+int
+PLCB_args_multi(PLCB_t *object, int cmdbase, SV *options, lcb_CMDBASE *cmd)
+{
+    plcb_SINGLEOP so = { cmdbase };
+    UV exp = 0;
+    plcb_OPTION exp_specs[] = {
+        PLCB_KWARG(PLCB_ARG_K_EXPIRY, EXP, &exp),
+        {NULL}
+    };
+
+    if (options && SvTYPE(options) != SVt_NULL) {
+        if (SvROK(options) == 0 || SvTYPE(SvRV(options)) != SVt_PVHV) {
+            die("options must be undef or a HASH reference");
+        }
+        so.cmdopts = options;
+    }
+
+    if (cmdbase == PLCB_CMD_COUNTER) {
+        return PLCB_args_arithmetic(object, &so, (lcb_CMDCOUNTER *)cmd);
+    }
+
+    if (cmdbase == PLCB_CMD_GAT || cmdbase == PLCB_CMD_TOUCH) {
+        if (so.cmdopts) {
+            plcb_extract_args(so.cmdopts, exp_specs);
+        }
+        cmd->exptime = exp;
+    } else if (cmdbase != PLCB_CMD_GET && cmdbase != PLCB_CMD_REMOVE) {
+        die("Command %d cannot be used with multiple keys", cmdbase);
+    }
+    return 0;
+}
+
+int
+PLCB_args_store_multi(PLCB_t *object, int cmdbase, SV *options,
+    lcb_CMDSTORE *scmd, plcb_DOCVAL *vspec, int *durability)
+{
+    UV exp = 0;
+    int persist_to = 0, replicate_to = 0;
+    plcb_OPTION opt_specs[] = {
+        PLCB_KWARG(PLCB_ARG_K_EXPIRY, EXP, &exp),
+        PLCB_KWARG(PLCB_ARG_K_FMT, U32, &vspec->spec),
+        PLCB_KWARG(PLCB_ARG_K_PERSIST, INT, &persist_to),
+        PLCB_KWARG(PLCB_ARG_K_REPLICATE, INT, &replicate_to),
+        { NULL }
+    };
+
+    if (cmdbase != PLCB_CMD_SET && cmdbase != PLCB_CMD_ADD &&
+            cmdbase != PLCB_CMD_REPLACE) {
+        die("Command %d cannot be used with multiple values", cmdbase);
+    }
+
+    vspec->spec = PLCB_CF_JSON;
+    if (options && SvTYPE(options) != SVt_NULL) {
+        if (SvROK(options) == 0 || SvTYPE(SvRV(options)) != SVt_PVHV) {
+            die("options must be undef or a HASH reference");
+        }
+        plcb_extract_args(options, opt_specs);
+    }
+
+    scmd->exptime = exp;
+    *durability = PLCB_MKDURABILITY(persist_to, replicate_to);
+    return 0;
+}
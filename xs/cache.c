@@ -0,0 +1,318 @@
+#include "perl-couchbase.h"
+#include <sys/time.h>
+
+/* Client-side cache of fetched values, keyed by document ID. Entries are
+ * kept in an LRU list, with the most recently used entry at the head.
+ *
+ * An entry younger than `max_age` is returned without contacting the server.
+ * Once it is older, the next get goes to the network, and the entry is
+ * refreshed from the response. Entries hold the stored bytes rather than the
+ * decoded value, and each hit decodes its own copy, so that a document
+ * modified in place by the application cannot change the cached value. */
+
+typedef struct plcb_CACHEENT_st {
+    struct plcb_CACHEENT_st *prev;
+    struct plcb_CACHEENT_st *next;
+    SV *key;
+    SV *value; /* Value as received from the server */
+    lcb_U64 cas;
+    lcb_U32 itmflags;
+    NV expires; /* Time after which the entry must be revalidated */
+} plcb_CACHEENT;
+
+/* Negative cache. Maps IDs recently found to be missing to the time at which
+ * the entry expires */
+struct plcb_NEGCACHE_st {
+    HV *keys;
+    unsigned maxitems;
+    NV ttl;
+    UV hits;
+};
+
+struct plcb_CACHE_st {
+    HV *index; /* ID => plcb_CACHEENT pointer */
+    plcb_CACHEENT lru; /* Sentinel. lru.next is the most recently used */
+    unsigned nitems;
+    unsigned maxitems;
+    NV max_age;
+    UV hits;
+    UV misses;
+    UV revalidated;
+    UV evictions;
+};
+
+static NV
+cache_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static void
+lru_unlink(plcb_CACHEENT *ent)
+{
+    ent->prev->next = ent->next;
+    ent->next->prev = ent->prev;
+}
+
+static void
+lru_push(plcb_CACHE *cache, plcb_CACHEENT *ent)
+{
+    ent->next = cache->lru.next;
+    ent->prev = &cache->lru;
+    cache->lru.next->prev = ent;
+    cache->lru.next = ent;
+}
+
+static plcb_CACHEENT *
+cache_find(plcb_CACHE *cache, const char *key, size_t nkey)
+{
+    SV **ptr = hv_fetch(cache->index, key, nkey, 0);
+    if (!ptr) {
+        return NULL;
+    }
+    return NUM2PTR(plcb_CACHEENT*, SvIVX(*ptr));
+}
+
+static void
+cache_delete(plcb_CACHE *cache, plcb_CACHEENT *ent)
+{
+    lru_unlink(ent);
+    (void)hv_delete_ent(cache->index, ent->key, G_DISCARD, 0);
+    SvREFCNT_dec(ent->key);
+    SvREFCNT_dec(ent->value);
+    Safefree(ent);
+    cache->nitems--;
+}
+
+static void
+cache_purge(plcb_CACHE *cache)
+{
+    while (cache->lru.next != &cache->lru) {
+        cache_delete(cache, cache->lru.next);
+    }
+}
+
+void
+plcb_cache_configure(PLCB_t *object, unsigned maxitems, NV max_age)
+{
+    plcb_CACHE *cache = object->cache;
+
+    if (maxitems == 0) {
+        plcb_cache_destroy(object);
+        return;
+    }
+
+    if (!cache) {
+        Newxz(cache, 1, plcb_CACHE);
+        cache->index = newHV();
+        cache->lru.next = cache->lru.prev = &cache->lru;
+        object->cache = cache;
+    }
+
+    cache->maxitems = maxitems;
+    cache->max_age = max_age;
+
+    while (cache->nitems > cache->maxitems) {
+        cache_delete(cache, cache->lru.prev);
+        cache->evictions++;
+    }
+}
+
+void
+plcb_cache_destroy(PLCB_t *object)
+{
+    plcb_CACHE *cache = object->cache;
+    if (!cache) {
+        return;
+    }
+    cache_purge(cache);
+    SvREFCNT_dec(cache->index);
+    Safefree(cache);
+    object->cache = NULL;
+}
+
+void
+plcb_cache_clear(PLCB_t *object)
+{
+    if (object->cache) {
+        cache_purge(object->cache);
+    }
+    if (object->negcache) {
+        hv_clear(object->negcache->keys);
+    }
+}
+
+/* Fills the document from a fresh entry, if one exists. Returns true if the
+ * document was filled */
+int
+plcb_cache_fill(PLCB_t *object, AV *docav, const char *key, size_t nkey)
+{
+    plcb_CACHE *cache = object->cache;
+    plcb_CACHEENT *ent = cache_find(cache, key, nkey);
+
+    if (!ent || ent->expires < cache_now()) {
+        cache->misses++;
+        return 0;
+    }
+
+    lru_unlink(ent);
+    lru_push(cache, ent);
+    cache->hits++;
+
+    av_store(docav, PLCB_RETIDX_VALUE, plcb_convert_retrieval(object, docav,
+        SvPVX(ent->value), SvCUR(ent->value), ent->itmflags));
+    plcb_doc_clear_lazy(docav);
+    plcb_doc_set_cas(object, docav, &ent->cas);
+    plcb_doc_set_err(object, docav, LCB_SUCCESS);
+    return 1;
+}
+
+/* Called with a value received from the server. If the entry's CAS matches,
+ * the value is unchanged and the entry is only refreshed */
+void
+plcb_cache_store(PLCB_t *object, const char *key, size_t nkey,
+    const char *value, size_t nvalue, lcb_U64 cas, lcb_U32 itmflags)
+{
+    plcb_CACHE *cache = object->cache;
+    plcb_CACHEENT *ent = cache_find(cache, key, nkey);
+
+    if (ent && ent->cas == cas) {
+        cache->revalidated++;
+        lru_unlink(ent);
+
+    } else {
+        if (ent) {
+            lru_unlink(ent);
+            SvREFCNT_dec(ent->value);
+        } else {
+            Newxz(ent, 1, plcb_CACHEENT);
+            ent->key = newSVpvn(key, nkey);
+            (void)hv_store_ent(cache->index, ent->key, newSViv(PTR2IV(ent)), 0);
+            cache->nitems++;
+        }
+        ent->value = newSVpvn(value, nvalue);
+        ent->cas = cas;
+        ent->itmflags = itmflags;
+    }
+
+    ent->expires = cache_now() + cache->max_age;
+    lru_push(cache, ent);
+
+    while (cache->nitems > cache->maxitems) {
+        cache_delete(cache, cache->lru.prev);
+        cache->evictions++;
+    }
+}
+
+void
+plcb_cache_remove(PLCB_t *object, const char *key, size_t nkey)
+{
+    plcb_CACHEENT *ent = cache_find(object->cache, key, nkey);
+    if (ent) {
+        cache_delete(object->cache, ent);
+    }
+}
+
+HV *
+plcb_cache_stats(PLCB_t *object)
+{
+    plcb_CACHE *cache = object->cache;
+    plcb_NEGCACHE *neg = object->negcache;
+    HV *ret = newHV();
+
+    if (neg) {
+        (void)hv_stores(ret, "negative_items", newSVuv(HvUSEDKEYS(neg->keys)));
+        (void)hv_stores(ret, "negative_hits", newSVuv(neg->hits));
+    }
+    (void)hv_stores(ret, "encode_hits", newSVuv(object->nenchits));
+    (void)hv_stores(ret, "encode_misses", newSVuv(object->nencmisses));
+    if (!cache) {
+        return ret;
+    }
+
+    (void)hv_stores(ret, "items", newSVuv(cache->nitems));
+    (void)hv_stores(ret, "max_items", newSVuv(cache->maxitems));
+    (void)hv_stores(ret, "max_age", newSVnv(cache->max_age));
+    (void)hv_stores(ret, "hits", newSVuv(cache->hits));
+    (void)hv_stores(ret, "misses", newSVuv(cache->misses));
+    (void)hv_stores(ret, "revalidated", newSVuv(cache->revalidated));
+    (void)hv_stores(ret, "evictions", newSVuv(cache->evictions));
+    return ret;
+}
+
+void
+plcb_negcache_configure(PLCB_t *object, unsigned maxitems, NV ttl)
+{
+    plcb_NEGCACHE *neg = object->negcache;
+
+    if (maxitems == 0 || ttl <= 0) {
+        plcb_negcache_destroy(object);
+        return;
+    }
+    if (!neg) {
+        Newxz(neg, 1, plcb_NEGCACHE);
+        neg->keys = newHV();
+        object->negcache = neg;
+    }
+    neg->maxitems = maxitems;
+    neg->ttl = ttl;
+}
+
+void
+plcb_negcache_destroy(PLCB_t *object)
+{
+    if (!object->negcache) {
+        return;
+    }
+    SvREFCNT_dec(object->negcache->keys);
+    Safefree(object->negcache);
+    object->negcache = NULL;
+}
+
+/* Returns true if the ID was recently found to be missing */
+int
+plcb_negcache_check(PLCB_t *object, const char *key, size_t nkey)
+{
+    plcb_NEGCACHE *neg = object->negcache;
+    SV **ent = hv_fetch(neg->keys, key, nkey, 0);
+
+    if (!ent) {
+        return 0;
+    }
+    if (SvNVX(*ent) < cache_now()) {
+        (void)hv_delete(neg->keys, key, nkey, G_DISCARD);
+        return 0;
+    }
+    neg->hits++;
+    return 1;
+}
+
+void
+plcb_negcache_add(PLCB_t *object, const char *key, size_t nkey)
+{
+    plcb_NEGCACHE *neg = object->negcache;
+    NV now = cache_now();
+
+    if (HvUSEDKEYS(neg->keys) >= neg->maxitems) {
+        /* Drop expired entries. If that isn't enough, start over */
+        HE *he;
+        hv_iterinit(neg->keys);
+        while ((he = hv_iternext(neg->keys))) {
+            if (SvNVX(HeVAL(he)) < now) {
+                (void)hv_delete_ent(neg->keys, hv_iterkeysv(he), G_DISCARD, 0);
+            }
+        }
+        if (HvUSEDKEYS(neg->keys) >= neg->maxitems) {
+            hv_clear(neg->keys);
+        }
+    }
+    (void)hv_store(neg->keys, key, nkey, newSVnv(now + neg->ttl), 0);
+}
+
+void
+plcb_negcache_remove(PLCB_t *object, const char *key, size_t nkey)
+{
+    (void)hv_delete(object->negcache->keys, key, nkey, G_DISCARD);
+}
@@ -9,14 +9,56 @@ void plcb_evloop_wait_unref(PLCB_t *obj) {
     }
 }
 
+/* Issues a durability check for a single document, in its own context. The
+ * response uses the document's own cookie */
 static int
-chain_endure(PLCB_t *obj, AV *resobj, const lcb_RESPSTORE *resp)
+endure_single(PLCB_t *obj, plcb_OPSLOT *slot, AV *resobj,
+    const lcb_durability_opts_t *dopts, const lcb_CMDENDURE *dcmd)
 {
     lcb_MULTICMD_CTX *mctx = NULL;
+    lcb_error_t err = LCB_SUCCESS;
+
+    mctx = lcb_endure3_ctxnew(obj->instance, dopts, &err);
+    if (mctx == NULL) {
+        plcb_doc_set_err(obj, resobj, err);
+        return 0;
+    }
+
+    err = mctx->addcmd(mctx, (const lcb_CMDBASE *)dcmd);
+    if (err != LCB_SUCCESS) {
+        mctx->fail(mctx);
+        plcb_doc_set_err(obj, resobj, err);
+        return 0;
+    }
+
+    plcb_autobatch_flush(obj);
+    lcb_sched_enter(obj->instance);
+    err = mctx->done(mctx, slot);
+    if (err != LCB_SUCCESS) {
+        plcb_sched_fail(obj);
+        plcb_doc_set_err(obj, resobj, err);
+        return 0;
+    }
+
+    plcb_sched_leave(obj);
+    return 1;
+}
+
+/* Adds a durability check for a stored document, if one was requested.
+ * Checks are grouped by their requirements and are only submitted once
+ * every other operation in the context has completed (see
+ * submit_durability()). Returns true if the document now awaits its
+ * durability response */
+static int
+chain_endure(PLCB_t *obj, plcb_OPCTX *ctx, plcb_OPSLOT *slot, AV *resobj,
+    const lcb_RESPSTORE *resp)
+{
+    plcb_DURGROUP *group;
     lcb_CMDENDURE dcmd = { 0 };
     lcb_durability_opts_t dopts = { 0 };
     char persist_to = 0, replicate_to = 0;
     lcb_error_t err = LCB_SUCCESS;
+    const lcb_MUTATION_TOKEN *token;
     SV *optsv;
 
     optsv = *av_fetch(resobj, PLCB_RETIDX_OPTIONS, 1);
@@ -37,75 +79,167 @@ chain_endure(PLCB_t *obj, AV *resobj, const lcb_RESPSTORE *resp)
     LCB_CMD_SET_KEY(&dcmd, resp->key, resp->nkey);
     dcmd.cas = resp->cas;
 
-    mctx = lcb_endure3_ctxnew(obj->instance, &dopts, &err);
-    if (mctx == NULL) {
-        plcb_doc_set_err(obj, resobj, err);
-        return 0;
+    /* Poll by sequence number if requested and the server gave us a token.
+     * Otherwise fall back to comparing the CAS */
+    if (obj->durmode == LCB_DURABILITY_MODE_SEQNO) {
+        token = lcb_resp_get_mutation_token(LCB_CALLBACK_STORE,
+            (const lcb_RESPBASE *)resp);
+        if (LCB_MUTATION_TOKEN_ISVALID(token)) {
+            dcmd.mutation_token = token;
+            dcmd.cmdflags |= LCB_CMDENDURE_F_MUTATION_TOKEN;
+            dopts.v.v0.pollopts = LCB_DURABILITY_MODE_SEQNO;
+        }
     }
 
-    err = mctx->addcmd(mctx, (lcb_CMDBASE *)&dcmd);
-    if (err != LCB_SUCCESS) {
-        mctx->fail(mctx);
-        return 0;
+    /* Grouped responses are matched by key, so a key which is already known
+     * to the context gets a check of its own */
+    if (hv_exists(ctx->docs, resp->key, resp->nkey)) {
+        return endure_single(obj, slot, resobj, &dopts, &dcmd);
     }
 
-    lcb_sched_enter(obj->instance);
-    err = mctx->done(mctx, resp->cookie);
-    if (err != LCB_SUCCESS) {
-        plcb_doc_set_err(obj, resobj, err);
-        return 0;
+    for (group = ctx->durgroups; group; group = group->next) {
+        if (group->persist_to == persist_to &&
+                group->replicate_to == replicate_to &&
+                group->pollopts == dopts.v.v0.pollopts) {
+            break;
+        }
+    }
+
+    if (group == NULL) {
+        lcb_MULTICMD_CTX *mctx = lcb_endure3_ctxnew(obj->instance, &dopts, &err);
+        if (mctx == NULL) {
+            plcb_doc_set_err(obj, resobj, err);
+            return 0;
+        }
+        err = mctx->addcmd(mctx, (lcb_CMDBASE *)&dcmd);
+        if (err != LCB_SUCCESS) {
+            mctx->fail(mctx);
+            plcb_doc_set_err(obj, resobj, err);
+            return 0;
+        }
+
+        Newxz(group, 1, plcb_DURGROUP);
+        group->mctx = mctx;
+        group->docs = newAV();
+        group->persist_to = persist_to;
+        group->replicate_to = replicate_to;
+        group->pollopts = dopts.v.v0.pollopts;
+        group->next = ctx->durgroups;
+        ctx->durgroups = group;
+
+    } else {
+        err = group->mctx->addcmd(group->mctx, (lcb_CMDBASE *)&dcmd);
+        if (err != LCB_SUCCESS) {
+            plcb_doc_set_err(obj, resobj, err);
+            return 0;
+        }
     }
 
-    lcb_sched_leave(obj->instance);
+    (void)hv_store(ctx->docs, resp->key, resp->nkey, newRV_inc((SV *)resobj), 0);
+    av_push(group->docs, newRV_inc((SV *)resobj));
+    ctx->ndurable++;
     return 1;
 }
 
+/* Adds a single statistic to the document's value, which is a hash of
+ * server => { key => value } */
 static void
-call_helper(AV *resobj, int cbtype, const lcb_RESPBASE *resp)
+stats_result(AV *resobj, const lcb_RESPSTATS *resp)
 {
-    dSP;
-    const char *methname;
+    SV **tmp = av_fetch(resobj, PLCB_RETIDX_VALUE, 0);
+    HV *servers, *stats;
+    size_t nserver = strlen(resp->server);
 
-    ENTER;
-    SAVETMPS;
-    PUSHMARK(SP);
+    if (tmp && SvROK(*tmp) && SvTYPE(SvRV(*tmp)) == SVt_PVHV) {
+        servers = (HV *)SvRV(*tmp);
+    } else {
+        servers = newHV();
+        av_store(resobj, PLCB_RETIDX_VALUE, newRV_noinc((SV *)servers));
+    }
 
-    XPUSHs(sv_2mortal(newRV_inc((SV*)resobj)));
+    tmp = hv_fetch(servers, resp->server, nserver, 0);
+    if (tmp && SvROK(*tmp) && SvTYPE(SvRV(*tmp)) == SVt_PVHV) {
+        stats = (HV *)SvRV(*tmp);
+    } else {
+        stats = newHV();
+        (void)hv_store(servers, resp->server, nserver, newRV_noinc((SV *)stats), 0);
+    }
 
+    (void)hv_store(stats, resp->key, resp->nkey,
+        resp->value ? newSVpvn(resp->value, resp->nvalue) : newSV(0), 0);
+}
 
-    if (cbtype == LCB_CALLBACK_STATS) {
-        const lcb_RESPSTATS *sresp = (const void *)resp;
+/* Appends a { status, cas, master } record for a single node to the
+ * document's value */
+static void
+observe_result(AV *resobj, const lcb_RESPOBSERVE *resp)
+{
+    SV **tmp = av_fetch(resobj, PLCB_RETIDX_VALUE, 0);
+    AV *results;
+    HV *obs = newHV();
 
-        /** Call as statshelper($doc,$server,$key,$value); */
-        XPUSHs(sv_2mortal(newSVpv(sresp->server, 0)));
-        XPUSHs(sv_2mortal(newSVpvn(sresp->key, sresp->nkey)));
-        if (sresp->value) {
-            XPUSHs(sv_2mortal(newSVpvn(sresp->value, sresp->nvalue)));
-        }
-        methname = PLCB_STATS_PLHELPER;
+    if (tmp && SvROK(*tmp) && SvTYPE(SvRV(*tmp)) == SVt_PVAV) {
+        results = (AV *)SvRV(*tmp);
+    } else {
+        results = newAV();
+        av_store(resobj, PLCB_RETIDX_VALUE, newRV_noinc((SV *)results));
+    }
 
-    } else if (cbtype == LCB_CALLBACK_OBSERVE) {
-        const lcb_RESPOBSERVE *oresp = (const void *)resp;
+    (void)hv_stores(obs, "status", newSVuv(resp->status));
+    (void)hv_stores(obs, "cas", plcb_sv_from_u64_new(&resp->cas));
+    (void)hv_stores(obs, "master", newSVsv(boolSV(resp->ismaster)));
+    av_push(results, newRV_noinc((SV *)obs));
+}
 
-        /** Call as obshelper($doc,$status,$cas,$ismaster) */
-        XPUSHs(sv_2mortal(newSVuv(oresp->status)));
-        XPUSHs(sv_2mortal(plcb_sv_from_u64_new(&oresp->cas)));
-        XPUSHs(oresp->ismaster ? &PL_sv_yes : &PL_sv_no);
-        methname = PLCB_OBS_PLHELPER;
-    } else {
-        return;
+/* Builds the hash of path => result for a sub-document response. The spec
+ * list stored in the document is used to find the path for each result */
+static void
+subdoc_results(PLCB_t *parent, AV *resobj, int cbtype, const lcb_RESPSUBDOC *resp)
+{
+    HV *results = newHV();
+    SV **specrv = av_fetch(resobj, PLCB_RETIDX_VALUE, 0);
+    AV *specav = NULL;
+    lcb_SDENTRY ent;
+    size_t iter = 0;
+    int ix = 0;
+
+    if (specrv && plcb_is_arrayref(*specrv)) {
+        specav = (AV *)SvREFCNT_inc(SvRV(*specrv));
     }
 
-    PUTBACK;
-    call_pv(methname, G_DISCARD|G_EVAL);
-    SPAGAIN;
+    while (specav && lcb_sdresult_next(resp, &ent, &iter)) {
+        SV **tmp, **pathsv, **opsv;
+        AV *spec;
+        SV *val;
 
-    if (SvTRUE(ERRSV)) {
-        warn("Got error in %s: %s", methname, SvPV_nolen(ERRSV));
+        /* Lookups return an entry for each spec, in order. Mutations only
+         * return entries with values, and provide the spec index */
+        if (cbtype == LCB_CALLBACK_SDMUTATE) {
+            ix = ent.index;
+        }
+
+        tmp = av_fetch(specav, ix++, 0);
+        if (!tmp || !plcb_is_arrayref(*tmp)) {
+            continue;
+        }
+        spec = (AV *)SvRV(*tmp);
+        opsv = av_fetch(spec, 0, 0);
+        pathsv = av_fetch(spec, 1, 0);
+
+        if (opsv && strcmp(SvPV_nolen(*opsv), "exists") == 0) {
+            val = newSViv(ent.status == LCB_SUCCESS);
+        } else if (ent.status != LCB_SUCCESS || ent.nvalue == 0) {
+            continue;
+        } else {
+            val = plcb_convert_retrieval_ex(parent, resobj,
+                ent.value, ent.nvalue, PLCB_CF_JSON, PLCB_CONVERT_NOCUSTOM);
+        }
+
+        (void)hv_store_ent(results, pathsv ? *pathsv : &PL_sv_no, val, 0);
     }
 
-    FREETMPS;
-    LEAVE;
+    av_store(resobj, PLCB_RETIDX_VALUE, newRV_noinc((SV *)results));
+    SvREFCNT_dec((SV *)specav);
 }
 
 static void
@@ -144,25 +278,122 @@ call_async(plcb_OPCTX *ctx, AV *resobj)
     }
 }
 
-/* This callback is only ever called for single operation, single key results */
+static void submit_durability(PLCB_t *parent, SV *ctxrv, plcb_OPCTX *ctx);
+
+/* Delivers a finished document and releases the context once all of its
+ * operations are done. Consumes the caller's reference to the document */
+static void
+complete_doc(PLCB_t *parent, SV *ctxrv, plcb_OPCTX *ctx, AV *resobj)
+{
+    ctx->nremaining--;
+    parent->npending--;
+
+    if (parent->async) {
+        call_async(ctx, resobj);
+    } else if ((ctx->flags & PLCB_OPCTXf_IMPLICIT) == 0) {
+        /* Queued even when not waiting on this context, as its operations
+         * may be submitted while another context is waited for */
+        if (!ctx->u.ctxqueue) {
+            ctx->u.ctxqueue = newAV();
+        }
+        av_push(ctx->u.ctxqueue, newRV_inc( (SV* )resobj));
+        if (ctx->flags & PLCB_OPCTXf_WAITONE) {
+            plcb_kv_waitdone(parent);
+        }
+    }
+
+    if (!ctx->nremaining) {
+        plcb_kv_waitdone(parent);
+        plcb_opctx_finish(parent, ctxrv);
+    } else {
+        submit_durability(parent, ctxrv, ctx);
+    }
+    SvREFCNT_dec((SV *)resobj);
+    plcb_inflight_drain(parent);
+}
+
+/* Submits the pending durability groups once the only operations left in
+ * the context are the stores waiting on them. This way each node receives
+ * one round of observe requests for the whole context rather than one per
+ * document */
+static void
+submit_durability(PLCB_t *parent, SV *ctxrv, plcb_OPCTX *ctx)
+{
+    plcb_DURGROUP *groups = ctx->durgroups;
+
+    if (groups == NULL || ctx->nremaining != ctx->ndurable) {
+        return;
+    }
+
+    ctx->durgroups = NULL;
+    ctx->ndurable = 0;
+
+    while (groups) {
+        plcb_DURGROUP *group = groups;
+        lcb_error_t err;
+        groups = group->next;
+
+        plcb_autobatch_flush(parent);
+        lcb_sched_enter(parent->instance);
+        err = group->mctx->done(group->mctx, &ctx->keyslot);
+
+        if (err == LCB_SUCCESS) {
+            plcb_sched_leave(parent);
+        } else {
+            /* No responses will arrive for these documents */
+            I32 ii;
+            plcb_sched_fail(parent);
+            for (ii = 0; ii <= av_len(group->docs); ii++) {
+                AV *resobj = (AV *)SvRV(*av_fetch(group->docs, ii, 0));
+                plcb_doc_set_err(parent, resobj, err);
+                SvREFCNT_inc((SV *)resobj);
+                complete_doc(parent, ctxrv, ctx, resobj);
+            }
+        }
+        SvREFCNT_dec(group->docs);
+        Safefree(group);
+    }
+}
+
+/* This callback is only ever called for single operation, single key results.
+ * The cookie is the plcb_OPSLOT allocated when the operation was scheduled */
 static void
 callback_common(lcb_t instance, int cbtype, const lcb_RESPBASE *resp)
 {
     AV *resobj = NULL;
-    PLCB_t *parent;
-    SV *ctxrv = (SV *)resp->cookie;
-    plcb_OPCTX *ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(ctxrv)));
+    PLCB_t *parent = (PLCB_t *)lcb_get_cookie(instance);
+    plcb_OPSLOT *slot = (plcb_OPSLOT *)resp->cookie;
+    plcb_HEDGE *hedge = NULL;
+    SV *ctxrv;
+    plcb_OPCTX *ctx;
+
+    if (slot->flags & PLCB_OPSLOTf_HEDGE) {
+        hedge = (plcb_HEDGE *)slot;
+        hedge->npending--;
+
+        /* Discard the response if the other request already completed the
+         * document, or if this one failed and the other may still succeed */
+        if (hedge->done || (resp->rc != LCB_SUCCESS && hedge->npending)) {
+            if (hedge->done && hedge->npending == 0) {
+                Safefree(hedge);
+            }
+            return;
+        }
+        hedge->done = 1;
+        plcb_hedge_cancel(parent, hedge);
+        if (cbtype == LCB_CALLBACK_GETREPLICA) {
+            parent->nhedgewins++;
+        }
+    }
 
-    if (cbtype == LCB_CALLBACK_STATS || cbtype == LCB_CALLBACK_OBSERVE ||
-            cbtype == LCB_CALLBACK_HTTP) {
-        HE *tmp;
+    parent->inflight.nbytes -= slot->nbytes;
+    slot->nbytes = 0;
 
-        hv_iterinit(ctx->docs);
-        tmp = hv_iternext(ctx->docs);
+    ctxrv = slot->ctxrv;
+    ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(ctxrv)));
 
-        if (tmp && HeVAL(tmp) && SvROK(HeVAL(tmp))) {
-            resobj = (AV *)SvRV(HeVAL(tmp));
-        }
+    if (slot->docav) {
+        resobj = slot->docav;
     } else {
         SV **tmp = hv_fetch(ctx->docs, resp->key, resp->nkey, 0);
         if (tmp && SvROK(*tmp)) {
@@ -175,22 +406,107 @@ callback_common(lcb_t instance, int cbtype, const lcb_RESPBASE *resp)
         return;
     }
 
-    parent = (PLCB_t *)lcb_get_cookie(instance);
-    plcb_doc_set_err(parent, resobj, resp->rc);
+    if (cbtype != LCB_CALLBACK_GETREPLICA) {
+        plcb_doc_set_err(parent, resobj, resp->rc);
+    }
+
+    if (resp->rc == LCB_SUCCESS && (cbtype == LCB_CALLBACK_STORE ||
+            cbtype == LCB_CALLBACK_REMOVE || cbtype == LCB_CALLBACK_COUNTER ||
+            cbtype == LCB_CALLBACK_SDMUTATE)) {
+        plcb_doc_set_token(parent, resobj,
+            lcb_resp_get_mutation_token(cbtype, resp));
+    }
+
+    if (parent->cache && (cbtype == LCB_CALLBACK_STORE ||
+            cbtype == LCB_CALLBACK_REMOVE || cbtype == LCB_CALLBACK_COUNTER ||
+            cbtype == LCB_CALLBACK_SDMUTATE)) {
+        plcb_cache_remove(parent, resp->key, resp->nkey);
+    }
+
+    if (parent->negcache) {
+        if (cbtype == LCB_CALLBACK_GET && resp->rc == LCB_KEY_ENOENT) {
+            plcb_negcache_add(parent, resp->key, resp->nkey);
+        } else if (cbtype == LCB_CALLBACK_STORE || cbtype == LCB_CALLBACK_COUNTER) {
+            plcb_negcache_remove(parent, resp->key, resp->nkey);
+        }
+    }
 
     switch (cbtype) {
     case LCB_CALLBACK_GET: {
         const lcb_RESPGET *gresp = (const lcb_RESPGET *)resp;
-        if (resp->rc == LCB_SUCCESS) {
+        if (resp->rc == LCB_SUCCESS &&
+                (parent->lazy_decode || (ctx->flags & PLCB_OPCTXf_DEFERDECODE))) {
+            plcb_doc_set_lazy(parent, resobj, gresp->value, gresp->nvalue, gresp->itmflags);
+            plcb_doc_set_cas(parent, resobj, &resp->cas);
+            if (parent->cache) {
+                plcb_cache_store(parent, resp->key, resp->nkey,
+                    gresp->value, gresp->nvalue, resp->cas, gresp->itmflags);
+            }
+            if (ctx->flags & PLCB_OPCTXf_DEFERDECODE) {
+                /* Consumed by each wait_all() of a reused context */
+                if (ctx->deferred == NULL) {
+                    ctx->deferred = newAV();
+                }
+                av_push(ctx->deferred, newRV_inc((SV *)resobj));
+            }
+
+        } else if (resp->rc == LCB_SUCCESS) {
             SV *newval = plcb_convert_retrieval(parent,
                 resobj, gresp->value, gresp->nvalue, gresp->itmflags);
 
+            if (parent->cache) {
+                plcb_cache_store(parent, resp->key, resp->nkey,
+                    gresp->value, gresp->nvalue, resp->cas, gresp->itmflags);
+            }
+
             av_store(resobj, PLCB_RETIDX_VALUE, newval);
+            plcb_doc_clear_lazy(resobj);
             plcb_doc_set_cas(parent, resobj, &resp->cas);
         }
         break;
     }
 
+    case LCB_CALLBACK_GETREPLICA: {
+        const lcb_RESPGET *gresp = (const lcb_RESPGET *)resp;
+        int curerr = plcb_doc_get_err(resobj);
+
+        /* With the 'all' strategy there is a response for each replica. Keep
+         * the one with the highest CAS, which is the most recent copy. A
+         * failure from one replica does not override success from another */
+        if (resp->rc == LCB_SUCCESS) {
+            SV **cassv = av_fetch(resobj, PLCB_RETIDX_CAS, 0);
+            if (curerr != LCB_SUCCESS || cassv == NULL ||
+                    plcb_sv2cas(*cassv) < resp->cas) {
+                if (parent->lazy_decode) {
+                    plcb_doc_set_lazy(parent, resobj,
+                        gresp->value, gresp->nvalue, gresp->itmflags);
+                } else {
+                    SV *newval = plcb_convert_retrieval(parent,
+                        resobj, gresp->value, gresp->nvalue, gresp->itmflags);
+                    av_store(resobj, PLCB_RETIDX_VALUE, newval);
+                    plcb_doc_clear_lazy(resobj);
+                }
+                plcb_doc_set_cas(parent, resobj, &resp->cas);
+                plcb_doc_set_err(parent, resobj, LCB_SUCCESS);
+            }
+        } else if (curerr != LCB_SUCCESS) {
+            plcb_doc_set_err(parent, resobj, resp->rc);
+        }
+
+        if ((resp->rflags & LCB_RESP_F_FINAL) == 0) {
+            return; /* More responses to come */
+        }
+        break;
+    }
+
+    case LCB_CALLBACK_SDLOOKUP:
+    case LCB_CALLBACK_SDMUTATE:
+        subdoc_results(parent, resobj, cbtype, (const lcb_RESPSUBDOC *)resp);
+        if (resp->cas) {
+            plcb_doc_set_cas(parent, resobj, &resp->cas);
+        }
+        break;
+
     case LCB_CALLBACK_TOUCH:
     case LCB_CALLBACK_REMOVE:
     case LCB_CALLBACK_UNLOCK:
@@ -201,7 +517,9 @@ callback_common(lcb_t instance, int cbtype, const lcb_RESPBASE *resp)
         }
 
         if (cbtype == LCB_CALLBACK_STORE && resp->rc == LCB_SUCCESS &&
-                chain_endure(parent, resobj, (const lcb_RESPSTORE *)resp)) {
+                chain_endure(parent, ctx, slot, resobj,
+                    (const lcb_RESPSTORE *)resp)) {
+            submit_durability(parent, ctxrv, ctx);
             return; /* Will be handled already */
         }
         break;
@@ -215,7 +533,7 @@ callback_common(lcb_t instance, int cbtype, const lcb_RESPBASE *resp)
     case LCB_CALLBACK_STATS: {
         const lcb_RESPSTATS *sresp = (const void *)resp;
         if (sresp->server) {
-            call_helper(resobj, cbtype, (const lcb_RESPBASE *)sresp);
+            stats_result(resobj, sresp);
             return;
         }
         break;
@@ -223,7 +541,7 @@ callback_common(lcb_t instance, int cbtype, const lcb_RESPBASE *resp)
     case LCB_CALLBACK_OBSERVE: {
         const lcb_RESPOBSERVE *oresp = (const lcb_RESPOBSERVE*)resp;
         if (oresp->nkey) {
-            call_helper(resobj, cbtype, (const lcb_RESPBASE*)oresp);
+            observe_result(resobj, oresp);
             return;
         }
         break;
@@ -268,19 +586,17 @@ callback_common(lcb_t instance, int cbtype, const lcb_RESPBASE *resp)
         break;
     }
 
-    ctx->nremaining--;
-
-    if (parent->async) {
-        call_async(ctx, resobj);
-    } else if (ctx->flags & PLCB_OPCTXf_WAITONE) {
-        av_push(ctx->u.ctxqueue, newRV_inc( (SV* )resobj));
-        plcb_kv_waitdone(parent);
+    /* Take over the slot's reference to the document; the operation is done */
+    if (slot->docav) {
+        slot->docav = NULL;
+    } else {
+        SvREFCNT_inc((SV *)resobj);
     }
 
-    if (!ctx->nremaining) {
-        SvREFCNT_dec(ctxrv);
-        plcb_kv_waitdone(parent);
-        plcb_opctx_clear(parent);
+    complete_doc(parent, ctxrv, ctx, resobj);
+
+    if (hedge && hedge->npending == 0) {
+        Safefree(hedge);
     }
 }
 
@@ -326,5 +642,7 @@ plcb_callbacks_setup(PLCB_t *object)
     lcb_install_callback3(o, LCB_CALLBACK_STATS, callback_common);
     lcb_install_callback3(o, LCB_CALLBACK_OBSERVE, callback_common);
     lcb_install_callback3(o, LCB_CALLBACK_HTTP, callback_common);
+    lcb_install_callback3(o, LCB_CALLBACK_SDLOOKUP, callback_common);
+    lcb_install_callback3(o, LCB_CALLBACK_SDMUTATE, callback_common);
     lcb_set_bootstrap_callback(o, bootstrap_callback);
 }
@@ -0,0 +1,397 @@
+#include "perl-couchbase.h"
+
+#ifdef PLCB_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef PLCB_HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+/* Transparent compression of encoded values. A compressed value is stored
+ * as the 4 byte length of the original and the 2 byte ID of the dictionary
+ * used (0 for none), both little endian, followed by the compressed data.
+ * The codec is recorded in the item flags (PLCB_CMPF_*).
+ *
+ * Values are only compressed when they are at least `min_size` bytes, and
+ * only kept compressed if that actually makes them smaller. */
+
+/* Largest value we are willing to decompress */
+#define PLCB_COMPRESS_MAXSIZE (256 * 1024 * 1024)
+#define PLCB_COMPRESS_HDRSIZE 6
+#define PLCB_COMPRESS_MAXDICT 0xFFFF
+
+#ifdef PLCB_HAVE_ZSTD
+typedef struct {
+    unsigned id;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+} plcb_ZDICT;
+#endif
+
+struct plcb_COMPRESS_st {
+    lcb_U32 method; /* PLCB_CMPF_*, or 0 if only decompressing */
+    size_t min_size;
+    unsigned dict_id; /* Dictionary to compress with, 0 for none */
+#ifdef PLCB_HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    plcb_ZDICT *dicts;
+    unsigned ndicts;
+#endif
+};
+
+#ifdef PLCB_HAVE_ZSTD
+static plcb_ZDICT *
+find_dict(plcb_COMPRESS *cmp, unsigned id)
+{
+    unsigned ii;
+    if (cmp == NULL) {
+        return NULL;
+    }
+    for (ii = 0; ii < cmp->ndicts; ii++) {
+        if (cmp->dicts[ii].id == id) {
+            return cmp->dicts + ii;
+        }
+    }
+    return NULL;
+}
+#endif
+
+static plcb_COMPRESS *
+get_compress(PLCB_t *object)
+{
+    if (!object->compress) {
+        Newxz(object->compress, 1, plcb_COMPRESS);
+    }
+    return object->compress;
+}
+
+void
+plcb_compress_configure(PLCB_t *object, const char *method, size_t min_size, unsigned dict_id)
+{
+    lcb_U32 flag;
+
+    if (method == NULL || strcmp(method, "none") == 0) {
+        if (object->compress) {
+            object->compress->method = 0;
+        }
+        return;
+    } else if (strcmp(method, "lz4") == 0) {
+#ifndef PLCB_HAVE_LZ4
+        die("LZ4 support was not compiled in. Rebuild with `perl Makefile.PL --with-lz4`");
+#endif
+        if (dict_id) {
+            die("LZ4 compression does not support dictionaries");
+        }
+        flag = PLCB_CMPF_LZ4;
+    } else if (strcmp(method, "zstd") == 0) {
+#ifndef PLCB_HAVE_ZSTD
+        die("Zstandard support was not compiled in. Rebuild with `perl Makefile.PL --with-zstd`");
+#else
+        if (dict_id && find_dict(object->compress, dict_id) == NULL) {
+            die("Compression dictionary %u has not been added", dict_id);
+        }
+#endif
+        flag = PLCB_CMPF_ZSTD;
+    } else {
+        die("Unknown compression method '%s'", method);
+    }
+
+    get_compress(object);
+    object->compress->method = flag;
+    object->compress->min_size = min_size;
+    object->compress->dict_id = dict_id;
+}
+
+void
+plcb_compress_add_dict(PLCB_t *object, unsigned id, const char *data, size_t len)
+{
+#ifdef PLCB_HAVE_ZSTD
+    plcb_COMPRESS *cmp;
+    plcb_ZDICT *dict;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+
+    if (id == 0 || id > PLCB_COMPRESS_MAXDICT) {
+        die("Dictionary ID must be between 1 and %d", PLCB_COMPRESS_MAXDICT);
+    }
+
+    cdict = ZSTD_createCDict(data, len, ZSTD_CLEVEL_DEFAULT);
+    ddict = ZSTD_createDDict(data, len);
+    if (cdict == NULL || ddict == NULL) {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+        die("Couldn't load compression dictionary %u", id);
+    }
+
+    cmp = get_compress(object);
+    if ((dict = find_dict(cmp, id)) != NULL) {
+        /* Replacing an existing dictionary */
+        ZSTD_freeCDict(dict->cdict);
+        ZSTD_freeDDict(dict->ddict);
+    } else {
+        Renew(cmp->dicts, cmp->ndicts + 1, plcb_ZDICT);
+        dict = cmp->dicts + cmp->ndicts++;
+        dict->id = id;
+    }
+    dict->cdict = cdict;
+    dict->ddict = ddict;
+#else
+    (void)object; (void)id; (void)data; (void)len;
+    die("Zstandard support was not compiled in. Rebuild with `perl Makefile.PL --with-zstd`");
+#endif
+}
+
+void
+plcb_compress_destroy(PLCB_t *object)
+{
+    plcb_COMPRESS *cmp = object->compress;
+    if (cmp == NULL) {
+        return;
+    }
+
+#ifdef PLCB_HAVE_ZSTD
+    {
+        unsigned ii;
+        for (ii = 0; ii < cmp->ndicts; ii++) {
+            ZSTD_freeCDict(cmp->dicts[ii].cdict);
+            ZSTD_freeDDict(cmp->dicts[ii].ddict);
+        }
+        Safefree(cmp->dicts);
+        ZSTD_freeCCtx(cmp->cctx);
+        ZSTD_freeDCtx(cmp->dctx);
+    }
+#endif
+
+    Safefree(cmp);
+    object->compress = NULL;
+}
+
+#if defined(PLCB_HAVE_LZ4) || defined(PLCB_HAVE_ZSTD)
+static void
+write_header(char *buf, size_t len, unsigned dict_id)
+{
+    buf[0] = (char)(len & 0xFF);
+    buf[1] = (char)((len >> 8) & 0xFF);
+    buf[2] = (char)((len >> 16) & 0xFF);
+    buf[3] = (char)((len >> 24) & 0xFF);
+    buf[4] = (char)(dict_id & 0xFF);
+    buf[5] = (char)((dict_id >> 8) & 0xFF);
+}
+#endif
+
+static size_t
+read_header(const char *buf, unsigned *dict_id)
+{
+    const U8 *u = (const U8 *)buf;
+    *dict_id = u[4] | (u[5] << 8);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((size_t)u[3] << 24);
+}
+
+#ifdef PLCB_HAVE_ZSTD
+static SV *
+compress_zstd(plcb_COMPRESS *cmp, const char *data, size_t len)
+{
+    size_t bound = ZSTD_compressBound(len), nout;
+    SV *ret;
+    char *buf;
+
+    if (cmp->cctx == NULL && (cmp->cctx = ZSTD_createCCtx()) == NULL) {
+        return NULL;
+    }
+
+    ret = newSV(PLCB_COMPRESS_HDRSIZE + bound);
+    buf = SvPVX(ret);
+    if (cmp->dict_id) {
+        nout = ZSTD_compress_usingCDict(cmp->cctx, buf + PLCB_COMPRESS_HDRSIZE,
+            bound, data, len, find_dict(cmp, cmp->dict_id)->cdict);
+    } else {
+        nout = ZSTD_compressCCtx(cmp->cctx, buf + PLCB_COMPRESS_HDRSIZE,
+            bound, data, len, ZSTD_CLEVEL_DEFAULT);
+    }
+    if (ZSTD_isError(nout)) {
+        SvREFCNT_dec(ret);
+        return NULL;
+    }
+    write_header(buf, len, cmp->dict_id);
+    SvCUR_set(ret, PLCB_COMPRESS_HDRSIZE + nout);
+    SvPOK_only(ret);
+    return ret;
+}
+#endif
+
+/* Compresses an encoded value. Returns a new SV and adds the codec to
+ * `flags`, or returns NULL if the value should be stored as-is */
+SV *
+plcb_compress(PLCB_t *object, const char *data, size_t len, lcb_U32 *flags)
+{
+    plcb_COMPRESS *cmp = object->compress;
+    SV *ret = NULL;
+
+    if (!cmp->method || len < cmp->min_size || len > PLCB_COMPRESS_MAXSIZE) {
+        return NULL;
+    }
+
+#ifdef PLCB_HAVE_LZ4
+    if (cmp->method == PLCB_CMPF_LZ4) {
+        int bound = LZ4_compressBound((int)len);
+        int nout;
+        char *buf;
+
+        ret = newSV(PLCB_COMPRESS_HDRSIZE + bound);
+        buf = SvPVX(ret);
+        nout = LZ4_compress_default(data, buf + PLCB_COMPRESS_HDRSIZE, (int)len, bound);
+        if (nout <= 0) {
+            SvREFCNT_dec(ret);
+            return NULL;
+        }
+        write_header(buf, len, 0);
+        SvCUR_set(ret, PLCB_COMPRESS_HDRSIZE + nout);
+        SvPOK_only(ret);
+    }
+#endif
+#ifdef PLCB_HAVE_ZSTD
+    if (cmp->method == PLCB_CMPF_ZSTD) {
+        ret = compress_zstd(cmp, data, len);
+    }
+#endif
+
+    if (ret && SvCUR(ret) >= len) {
+        /* Not worth it */
+        SvREFCNT_dec(ret);
+        return NULL;
+    }
+    if (ret) {
+        *flags |= cmp->method;
+    }
+    return ret;
+}
+
+/* Decompresses a value received from the server. Returns a new SV with the
+ * original data, or NULL (and sets `errp`) if this is not possible */
+SV *
+plcb_decompress(PLCB_t *object, const char *data, size_t len, lcb_U32 flags, const char **errp)
+{
+    size_t origlen;
+    unsigned dict_id;
+    SV *ret;
+
+    if (len < PLCB_COMPRESS_HDRSIZE) {
+        *errp = "compressed value is truncated";
+        return NULL;
+    }
+    origlen = read_header(data, &dict_id);
+    if (origlen > PLCB_COMPRESS_MAXSIZE) {
+        *errp = "compressed value is too large";
+        return NULL;
+    }
+
+    data += PLCB_COMPRESS_HDRSIZE;
+    len -= PLCB_COMPRESS_HDRSIZE;
+    ret = newSV(origlen + 1);
+
+    switch (flags & PLCB_CMPF_MASK) {
+#ifdef PLCB_HAVE_LZ4
+    case PLCB_CMPF_LZ4: {
+        int nout;
+        if (dict_id) {
+            *errp = "LZ4 value has a dictionary";
+            goto GT_ERR;
+        }
+        nout = LZ4_decompress_safe(data, SvPVX(ret), (int)len, (int)origlen);
+        if (nout < 0 || (size_t)nout != origlen) {
+            *errp = "corrupt LZ4 data";
+            goto GT_ERR;
+        }
+        break;
+    }
+#endif
+#ifdef PLCB_HAVE_ZSTD
+    case PLCB_CMPF_ZSTD: {
+        plcb_COMPRESS *cmp = get_compress(object);
+        size_t nout;
+
+        if (cmp->dctx == NULL && (cmp->dctx = ZSTD_createDCtx()) == NULL) {
+            *errp = "couldn't allocate zstd context";
+            goto GT_ERR;
+        }
+        if (dict_id) {
+            plcb_ZDICT *dict = find_dict(cmp, dict_id);
+            if (dict == NULL) {
+                *errp = "compression dictionary has not been added";
+                goto GT_ERR;
+            }
+            nout = ZSTD_decompress_usingDDict(cmp->dctx, SvPVX(ret), origlen, data, len, dict->ddict);
+        } else {
+            nout = ZSTD_decompressDCtx(cmp->dctx, SvPVX(ret), origlen, data, len);
+        }
+        if (ZSTD_isError(nout) || nout != origlen) {
+            *errp = "corrupt zstd data";
+            goto GT_ERR;
+        }
+        break;
+    }
+#endif
+    default:
+        *errp = "unsupported compression method";
+        goto GT_ERR;
+    }
+
+    SvCUR_set(ret, origlen);
+    *SvEND(ret) = '\0';
+    SvPOK_only(ret);
+    (void)object;
+    return ret;
+
+    GT_ERR:
+    SvREFCNT_dec(ret);
+    return NULL;
+}
+
+/* Trains a zstd dictionary from sample values. The samples are encoded as
+ * JSON, the same way they would be before being compressed */
+SV *
+plcb_compress_train(PLCB_t *object, AV *samples, size_t dict_size)
+{
+#ifdef PLCB_HAVE_ZSTD
+    SV *buf, *ret;
+    size_t *sizes, rv;
+    unsigned nsamples = 0;
+    I32 ii, nitems = av_len(samples) + 1;
+
+    buf = sv_2mortal(newSVpvn("", 0));
+    Newx(sizes, nitems ? nitems : 1, size_t);
+    SAVEFREEPV(sizes);
+
+    for (ii = 0; ii < nitems; ii++) {
+        SV **tmp = av_fetch(samples, ii, 0);
+        plcb_DOCVAL vspec = { 0 };
+
+        if (tmp == NULL || !SvOK(*tmp)) {
+            continue;
+        }
+        vspec.value = *tmp;
+        vspec.spec = PLCB_CF_JSON;
+        plcb_convert_storage_ex(object, NULL, &vspec, PLCB_CONVERT_NOCUSTOM);
+        sv_catpvn(buf, vspec.encoded, vspec.len);
+        sizes[nsamples++] = vspec.len;
+        plcb_convert_storage_free(object, &vspec);
+    }
+
+    ret = newSV(dict_size);
+    rv = ZDICT_trainFromBuffer(SvPVX(ret), dict_size, SvPVX(buf), sizes, nsamples);
+    if (ZDICT_isError(rv)) {
+        SvREFCNT_dec(ret);
+        die("Couldn't train dictionary from %u samples: %s", nsamples, ZDICT_getErrorName(rv));
+    }
+    SvCUR_set(ret, rv);
+    SvPOK_only(ret);
+    return ret;
+#else
+    (void)object; (void)samples; (void)dict_size;
+    die("Zstandard support was not compiled in. Rebuild with `perl Makefile.PL --with-zstd`");
+    return NULL;
+#endif
+}
@@ -38,6 +38,8 @@ plcb_define_constants(void)
     DEF_PRIV(RETIDX_FMTSPEC);
     DEF_PRIV(RETIDX_CAS);
     DEF_PRIV(RETIDX_EXP);
+    DEF_PRIV(RETIDX_TOKEN);
+    DEF_PRIV(RETIDX_LAZY);
 
     DEF_PRIV(VHIDX_PATH);
     DEF_PRIV(VHIDX_PARENT);
@@ -99,12 +101,14 @@ plcb_define_constants(void)
     ADD_PUBLIC("COUCHBASE_FMT_RAW", PLCB_CF_RAW);
     ADD_PUBLIC("COUCHBASE_FMT_UTF8", PLCB_CF_UTF8);
     ADD_PUBLIC("COUCHBASE_FMT_STORABLE", PLCB_CF_STORABLE);
+    ADD_PUBLIC("COUCHBASE_FMT_SEREAL", PLCB_CF_SEREAL);
 
     /* Error Codes */
     ADD_PUB_LCB(SUCCESS);
     ADD_PUB_LCB(AUTH_ERROR);
     ADD_PUB_LCB(DELTA_BADVAL);
     ADD_PUB_LCB(E2BIG);
+    ADD_PUB_LCB(EBUSY);
     ADD_PUB_LCB(EINVAL);
     ADD_PUB_LCB(ENOMEM);
     ADD_PUB_LCB(CLIENT_ENOMEM);
@@ -3,8 +3,10 @@
 #define CONVERT_OUT 1
 #define CONVERT_IN 2
 
+/* Calls a converter function. If `invocant` is not NULL, `meth` is called
+ * as a method on it */
 static SV*
-serialize_convert(SV *meth, SV *input, int direction)
+serialize_convert(SV *meth, SV *invocant, SV *input, int direction)
 {
     dSP;
     SV *ret;
@@ -14,6 +16,9 @@ serialize_convert(SV *meth, SV *input, int direction)
     SAVETMPS;
 
     PUSHMARK(SP);
+    if (invocant) {
+        XPUSHs(invocant);
+    }
     XPUSHs(input);
     PUTBACK;
 
@@ -50,66 +55,134 @@ serialize_convert(SV *meth, SV *input, int direction)
     return ret;
 }
 
+/* Points a reusable argument RV at `target`. The RV is replaced if the
+ * converter assigned to it or kept a reference to it */
+static void
+convarg_set(SV **rvp, SV *target)
+{
+    SV *rv = *rvp, *old;
+
+    if (rv == NULL || SvREFCNT(rv) != 1 || !SvROK(rv)) {
+        SvREFCNT_dec(rv);
+        *rvp = newRV_inc(target);
+        return;
+    }
+
+    old = SvRV(rv);
+    SvRV_set(rv, SvREFCNT_inc_simple_NN(target));
+    SvREFCNT_dec(old);
+}
+
+/* Calls a custom converter as `$conv->(\@doc, \$value, \$flags)`. The
+ * converter modifies the value and flags in place. The three argument RVs
+ * are allocated once per bucket and retargeted on each call */
 static SV *
-custom_convert(AV *docav, SV *meth, SV *input, uint32_t *flags, int direction)
+custom_convert(PLCB_t *object, AV *docav, SV *meth, SV *input, uint32_t *flags, int direction)
 {
     dSP;
-    SV *ret;
-    SV *flags_rv;
-    SV *input_rv;
-    int callflags;
+    plcb_CONVARGS tmpargs = { NULL }, *args = &object->convargs;
+    SV *ret, *flags_sv;
+    int failed;
 
-    ENTER; SAVETMPS;
-    PUSHMARK(SP);
+    if (args->busy) {
+        /* Converter called back into the bucket */
+        args = &tmpargs;
+    }
+    args->busy = 1;
 
-    input_rv = sv_2mortal(newRV_inc(input));
-    flags_rv = sv_2mortal(newRV_noinc(newSVuv(*flags)));
+    if (direction == CONVERT_OUT) {
+        /* Convert a copy, leaving the document's value alone */
+        ret = newSVsv(input);
+    } else {
+        ret = SvREFCNT_inc(input);
+    }
 
-    XPUSHs(sv_2mortal(newRV_inc( (SV *)docav)));
-    XPUSHs(input_rv);
-    XPUSHs(flags_rv);
+    convarg_set(&args->docrv, docav ? (SV *)docav : &PL_sv_undef);
+    convarg_set(&args->valrv, ret);
+    if (args->flagsrv == NULL || SvREFCNT(args->flagsrv) != 1 ||
+            !SvROK(args->flagsrv) || SvREFCNT(SvRV(args->flagsrv)) != 1) {
+        SvREFCNT_dec(args->flagsrv);
+        args->flagsrv = newRV_noinc(newSV(0));
+    }
+    flags_sv = SvRV(args->flagsrv);
+    sv_setuv(flags_sv, *flags);
 
+    PUSHMARK(SP);
+    XPUSHs(args->docrv);
+    XPUSHs(args->valrv);
+    XPUSHs(args->flagsrv);
     PUTBACK;
 
-    callflags = G_VOID|G_DISCARD;
-    if (direction == CONVERT_OUT) {
-        callflags |= G_EVAL;
+    call_sv(meth, G_VOID|G_DISCARD|G_EVAL);
+
+    failed = SvTRUE(ERRSV);
+    if (!failed) {
+        *flags = SvUV(flags_sv);
     }
 
-    call_sv(meth, callflags);
-    SPAGAIN;
+    /* Don't keep the document and value alive until the next call */
+    convarg_set(&args->docrv, &PL_sv_undef);
+    convarg_set(&args->valrv, &PL_sv_undef);
+    args->busy = 0;
 
-    if (SvTRUE(ERRSV)) {
-        ret = input;
-    } else {
-        warn("Conversion function failed");
-        ret = SvRV(input_rv);
-        *flags = SvUV(SvRV(flags_rv));
+    if (args == &tmpargs) {
+        SvREFCNT_dec(tmpargs.docrv);
+        SvREFCNT_dec(tmpargs.valrv);
+        SvREFCNT_dec(tmpargs.flagsrv);
     }
 
-    SvREFCNT_inc(ret);
+    if (failed) {
+        SvREFCNT_dec(ret);
+        if (direction == CONVERT_OUT) {
+            die("Custom encoder failed: %s", SvPV_nolen(ERRSV));
+        }
+        warn("Couldn't deserialize data: %s", SvPV_nolen(ERRSV));
+        ret = SvREFCNT_inc(input);
+    }
     return ret;
 }
 
 void
-plcb_convert_storage(PLCB_t *object, AV *docav, plcb_DOCVAL *vspec)
+plcb_convert_storage_ex(PLCB_t *object, AV *docav, plcb_DOCVAL *vspec, int options)
 {
     SV *pv = SvROK(vspec->value) ? SvRV(vspec->value) : vspec->value;
     uint32_t fmt = vspec->spec;
 
-    if (object->cv_customenc) {
+    if (docav && !(options & PLCB_CONVERT_NOCUSTOM) && plcb_doc_is_lazy(docav)) {
+        /* Value was never decoded. Store the same bytes with the same flags */
+        vspec->flags = fmt;
+        vspec->need_free = 0;
+        vspec->value = pv;
+        vspec->encoded = SvPV(pv, vspec->len);
+        return;
+    }
+
+    if (object->cv_customenc && !(options & PLCB_CONVERT_NOCUSTOM)) {
         vspec->need_free = 1;
-        vspec->value = custom_convert(docav, object->cv_customenc, vspec->value, &vspec->flags, CONVERT_OUT);
+        vspec->value = custom_convert(object, docav, object->cv_customenc, vspec->value, &vspec->flags, CONVERT_OUT);
 
     } else if (fmt == PLCB_CF_JSON) {
         vspec->flags = PLCB_LF_JSON|PLCB_CF_JSON;
         vspec->need_free = 1;
-        vspec->value = serialize_convert(object->cv_jsonenc, vspec->value, CONVERT_OUT);
+        if (object->cv_jsonenc) {
+            vspec->value = serialize_convert(object->cv_jsonenc, NULL, vspec->value, CONVERT_OUT);
+        } else {
+            vspec->value = plcb_json_encode(object, vspec->value);
+        }
 
     } else if (fmt == PLCB_CF_STORABLE) {
         vspec->flags = PLCB_CF_STORABLE | PLCB_LF_STORABLE;
         vspec->need_free = 1;
-        vspec->value = serialize_convert(object->cv_serialize, vspec->value, CONVERT_OUT);
+        vspec->value = serialize_convert(object->cv_serialize, NULL, vspec->value, CONVERT_OUT);
+
+    } else if (fmt == PLCB_CF_SEREAL) {
+        if (object->sereal_enc == NULL) {
+            die("Sereal::Encoder must be installed to use the Sereal format");
+        }
+        vspec->flags = PLCB_CF_SEREAL;
+        vspec->need_free = 1;
+        vspec->value = serialize_convert((SV *)object->sereal_enc_cv,
+            object->sereal_enc, vspec->value, CONVERT_OUT);
 
     } else if (fmt == PLCB_CF_RAW) {
         vspec->flags = PLCB_CF_RAW | PLCB_LF_RAW;
@@ -118,9 +191,20 @@ plcb_convert_storage(PLCB_t *object, AV *docav, plcb_DOCVAL *vspec)
             die("Raw conversion requires string value!");
         }
     } else if (vspec->spec == PLCB_CF_UTF8) {
+        STRLEN len;
+        const char *s = SvPV(pv, len);
+
         vspec->flags = PLCB_CF_UTF8 | PLCB_LF_UTF8;
         vspec->need_free = 0;
-        sv_utf8_upgrade(pv);
+        if (SvUTF8(pv)) {
+            /* Perl's own encoding also allows surrogates and larger code points */
+            if (object->strict_utf8 && !plcb_utf8_check(s, len)) {
+                die("Value is not valid UTF-8");
+            }
+        } else if (plcb_utf8_check(s, len) != PLCB_UTF8_ASCII) {
+            /* ASCII is already its own UTF-8 encoding */
+            sv_utf8_upgrade(pv);
+        }
 
     } else {
         die("Unrecognized flags used (0x%x) but no custom converted installed!", vspec->spec);
@@ -138,6 +222,71 @@ plcb_convert_storage(PLCB_t *object, AV *docav, plcb_DOCVAL *vspec)
     } else {
         vspec->encoded = SvPV(vspec->value, vspec->len);
     }
+
+    /* Only serialized formats are compressed, as raw and utf8 values may be
+     * appended to */
+    if (object->compress && !(options & PLCB_CONVERT_NOCUSTOM) && object->cv_customenc == NULL &&
+            (fmt == PLCB_CF_JSON || fmt == PLCB_CF_STORABLE || fmt == PLCB_CF_SEREAL)) {
+        SV *compressed = plcb_compress(object, vspec->encoded, vspec->len, &vspec->flags);
+        if (compressed) {
+            if (vspec->need_free) {
+                SvREFCNT_dec(vspec->value);
+            }
+            vspec->value = compressed;
+            vspec->need_free = 1;
+            vspec->encoded = SvPVX(compressed);
+            vspec->len = SvCUR(compressed);
+        }
+    }
+}
+
+/* `seen` maps the address of each structure encoded so far to an array of
+ * [ reference to the structure, encoded value, flags ]. Holding the
+ * reference keeps the address from being reused by another value. A
+ * json_encoder, Storable hook or Sereal FREEZE method may run between two
+ * values; these are assumed not to modify the other values being stored */
+void
+plcb_convert_storage_shared(PLCB_t *object, AV *docav, plcb_DOCVAL *vspec, HV *seen)
+{
+    uint32_t fmt = vspec->spec;
+    SV *pv, *encoded, **ent;
+    AV *entav;
+
+    /* Only structures are shared, keyed by what the reference points to */
+    if (object->cv_customenc || !SvROK(vspec->value) ||
+            (fmt != PLCB_CF_JSON && fmt != PLCB_CF_STORABLE && fmt != PLCB_CF_SEREAL)) {
+        plcb_convert_storage(object, docav, vspec);
+        return;
+    }
+
+    pv = SvRV(vspec->value);
+    ent = hv_fetch(seen, (const char *)&pv, sizeof pv, 0);
+    if (ent) {
+        entav = (AV *)SvRV(*ent);
+        encoded = *av_fetch(entav, 1, 0);
+        object->nenchits++;
+        vspec->value = SvREFCNT_inc(encoded);
+        vspec->need_free = 1;
+        vspec->encoded = SvPVX(encoded);
+        vspec->len = SvCUR(encoded);
+        vspec->flags = SvUV(*av_fetch(entav, 2, 0));
+        return;
+    }
+
+    plcb_convert_storage(object, docav, vspec);
+    object->nencmisses++;
+
+    /* Share the encoded value if nothing else can modify it */
+    if (vspec->need_free && SvREFCNT(vspec->value) == 1 && SvTYPE(vspec->value) == SVt_PV) {
+        encoded = SvREFCNT_inc(vspec->value);
+    } else {
+        encoded = newSVpvn(vspec->encoded, vspec->len);
+    }
+    entav = newAV();
+    av_push(entav, newRV_inc(pv));
+    av_push(entav, encoded);
+    av_push(entav, newSVuv(vspec->flags));
+    (void)hv_store(seen, (const char *)&pv, sizeof pv, newRV_noinc((SV *)entav), 0);
 }
 
 void plcb_convert_storage_free(PLCB_t *object, plcb_DOCVAL *vs)
@@ -151,33 +300,80 @@ SV*
 plcb_convert_retrieval_ex(PLCB_t *object, AV *docav,
     const char *data, size_t data_len, uint32_t flags, int options)
 {
-    SV *ret_sv, *input_sv, *flags_sv;
+    SV *ret_sv = NULL, *input_sv = NULL, *inflated = NULL, *flags_sv;
     uint32_t f_common, f_legacy;
-    input_sv = newSVpvn(data, data_len);
+
+    flags_sv = *av_fetch(docav, PLCB_RETIDX_FMTSPEC, 1);
+
+    /* Only formats this client compresses. Other clients may use the
+     * compression bits for something else */
+    f_common = flags & PLCB_CF_MASK & ~PLCB_CMPF_MASK;
+    if ((flags & PLCB_CMPF_MASK) &&
+            (f_common == PLCB_CF_JSON || f_common == PLCB_CF_PRIVATE)) {
+        const char *err = NULL;
+        inflated = plcb_decompress(object, data, data_len, flags, &err);
+        if (inflated == NULL) {
+            warn("Couldn't decompress value: %s", err);
+            sv_setuv(flags_sv, flags);
+            return newSVpvn(data, data_len);
+        }
+        data = SvPVX(inflated);
+        data_len = SvCUR(inflated);
+        flags &= ~PLCB_CMPF_MASK;
+    }
 
     f_common = flags & PLCB_CF_MASK;
     f_legacy = flags & PLCB_LF_MASK;
-    flags_sv = *av_fetch(docav, PLCB_RETIDX_FMTSPEC, 1);
 
 #define IS_FMT(fbase) f_common == PLCB_CF_##fbase || f_legacy == PLCB_LF_##fbase
 
     if (object->cv_customdec && options != PLCB_CONVERT_NOCUSTOM) {
-        ret_sv = custom_convert(docav, object->cv_customdec, input_sv, &flags, CONVERT_IN);
+        input_sv = newSVpvn(data, data_len);
+        ret_sv = custom_convert(object, docav, object->cv_customdec, input_sv, &flags, CONVERT_IN);
         /* Flags remain unchanged? */
 
     } else if (IS_FMT(JSON)) {
-        SvUTF8_on(input_sv);
-        ret_sv = serialize_convert(object->cv_jsondec, input_sv, CONVERT_IN);
         flags = PLCB_CF_JSON;
+        if (object->strict_utf8 && !plcb_utf8_check(data, data_len)) {
+            warn("Couldn't deserialize data: invalid UTF-8");
+            ret_sv = newSVpvn(data, data_len);
+        } else if (object->cv_jsondec == NULL) {
+            const char *err = NULL;
+            ret_sv = plcb_json_decode(data, data_len, &err);
+            if (ret_sv == NULL) {
+                warn("Couldn't deserialize data: %s", err);
+                ret_sv = newSVpvn(data, data_len);
+                SvUTF8_on(ret_sv);
+            }
+        } else {
+            input_sv = newSVpvn(data, data_len);
+            SvUTF8_on(input_sv);
+            ret_sv = serialize_convert(object->cv_jsondec, NULL, input_sv, CONVERT_IN);
+        }
+
+    } else if (f_legacy == PLCB_LF_SEREAL) {
+        input_sv = newSVpvn(data, data_len);
+        flags = PLCB_CF_SEREAL;
+        if (object->sereal_dec == NULL) {
+            warn("Couldn't deserialize data: Sereal::Decoder is not installed");
+            ret_sv = SvREFCNT_inc(input_sv);
+        } else {
+            ret_sv = serialize_convert((SV *)object->sereal_dec_cv,
+                object->sereal_dec, input_sv, CONVERT_IN);
+        }
 
     } else if (IS_FMT(STORABLE)) {
-        ret_sv = serialize_convert(object->cv_deserialize, input_sv, CONVERT_IN);
+        input_sv = newSVpvn(data, data_len);
+        ret_sv = serialize_convert(object->cv_deserialize, NULL, input_sv, CONVERT_IN);
         flags = PLCB_CF_STORABLE;
 
     } else if (IS_FMT(UTF8)) {
-        SvUTF8_on(input_sv);
-        ret_sv = input_sv;
-        SvREFCNT_inc(ret_sv);
+        ret_sv = newSVpvn(data, data_len);
+        if (object->strict_utf8 && !plcb_utf8_check(data, data_len)) {
+            warn("Couldn't deserialize data: invalid UTF-8");
+        } else {
+            SvUTF8_on(ret_sv);
+        }
         flags = PLCB_CF_UTF8;
 
     } else {
@@ -186,14 +382,116 @@ plcb_convert_retrieval_ex(PLCB_t *object, AV *docav,
         } else {
             warn("Unrecognized flags 0x%x. Assuming raw", flags);
         }
-        ret_sv = input_sv;
-        SvREFCNT_inc(ret_sv);
+        ret_sv = newSVpvn(data, data_len);
     }
 #undef IS_FMT
 
     SvREFCNT_dec(input_sv);
+    SvREFCNT_dec(inflated);
     if (SvIOK(flags_sv) == 0 || SvUVX(flags_sv) != flags) {
         sv_setuv(flags_sv, flags);
     }
     return ret_sv;
 }
+
+void
+plcb_doc_inflate(AV *docav)
+{
+    SV **tmp = av_fetch(docav, PLCB_RETIDX_LAZY, 0);
+    SV *objrv, *raw;
+    PLCB_t *object;
+    const char *data;
+    STRLEN len;
+
+    if (tmp == NULL || !SvROK(*tmp)) {
+        return;
+    }
+
+    /* Detach the pending state first, so that a failing decoder does not
+     * cause the value to be decoded again */
+    objrv = sv_2mortal(SvREFCNT_inc(*tmp));
+    av_delete(docav, PLCB_RETIDX_LAZY, G_DISCARD);
+    object = NUM2PTR(PLCB_t*, SvIV(SvRV(objrv)));
+
+    raw = sv_2mortal(SvREFCNT_inc(*av_fetch(docav, PLCB_RETIDX_VALUE, 1)));
+    data = SvPV(raw, len);
+    av_store(docav, PLCB_RETIDX_VALUE, plcb_convert_retrieval(object,
+        docav, data, len, plcb_doc_get_fmtspec(docav)));
+}
+
+/* Decodes an array of lazily fetched documents (as references). If
+ * `decode_many` is set, plain JSON values are passed to it together as an
+ * array of strings, and it must return an array of the decoded values in the
+ * same order. Other documents are decoded individually */
+void
+plcb_doc_inflate_many(PLCB_t *object, AV *docs, SV *decode_many)
+{
+    AV *batch = NULL, *strings = NULL, *results;
+    I32 ii, ndocs = av_len(docs) + 1, nbatch;
+    SV *ret;
+    int count;
+    dSP;
+
+    for (ii = 0; ii < ndocs; ii++) {
+        AV *docav = (AV *)SvRV(*av_fetch(docs, ii, 1));
+        lcb_U32 flags;
+
+        if (!plcb_doc_is_lazy(docav)) {
+            continue; /* Decoded or replaced already */
+        }
+
+        flags = plcb_doc_get_fmtspec(docav);
+        ret = *av_fetch(docav, PLCB_RETIDX_VALUE, 1);
+        if (decode_many == NULL || object->cv_customdec ||
+                (flags & PLCB_CMPF_MASK) ||
+                ((flags & PLCB_CF_MASK) != PLCB_CF_JSON &&
+                        (flags & PLCB_LF_MASK) != PLCB_LF_JSON) ||
+                (object->strict_utf8 && !plcb_utf8_check(SvPVX(ret), SvCUR(ret)))) {
+            plcb_doc_inflate(docav);
+            continue;
+        }
+
+        if (batch == NULL) {
+            batch = (AV *)sv_2mortal((SV *)newAV());
+            strings = (AV *)sv_2mortal((SV *)newAV());
+        }
+        av_push(batch, SvREFCNT_inc((SV *)docav));
+        SvUTF8_on(ret);
+        av_push(strings, SvREFCNT_inc(ret));
+    }
+
+    if (batch == NULL) {
+        return;
+    }
+
+    nbatch = av_len(batch) + 1;
+    ENTER; SAVETMPS;
+    PUSHMARK(SP);
+    XPUSHs(sv_2mortal(newRV_inc((SV *)strings)));
+    PUTBACK;
+
+    count = call_sv(decode_many, G_SCALAR|G_EVAL);
+    SPAGAIN;
+    ret = count == 1 ? POPs : &PL_sv_undef;
+    PUTBACK;
+
+    if (SvTRUE(ERRSV) || !plcb_is_arrayref(ret) ||
+            av_len((AV *)SvRV(ret)) + 1 != nbatch) {
+        warn("Couldn't deserialize data: %s", SvTRUE(ERRSV) ?
+            SvPV_nolen(ERRSV) : "decode_many must return an array of the same length");
+        for (ii = 0; ii < nbatch; ii++) {
+            plcb_doc_inflate((AV *)*av_fetch(batch, ii, 1));
+        }
+    } else {
+        results = (AV *)SvRV(ret);
+        for (ii = 0; ii < nbatch; ii++) {
+            AV *docav = (AV *)*av_fetch(batch, ii, 1);
+            SV **value = av_fetch(results, ii, 0);
+            av_store(docav, PLCB_RETIDX_VALUE, value ? newSVsv(*value) : newSV(0));
+            sv_setuv(*av_fetch(docav, PLCB_RETIDX_FMTSPEC, 1), PLCB_CF_JSON);
+            plcb_doc_clear_lazy(docav);
+        }
+    }
+
+    FREETMPS; LEAVE;
+}
@@ -0,0 +1,804 @@
+#include "perl-couchbase.h"
+
+/* Built-in JSON codec. This is used for the JSON format unless a
+ * json_encoder or json_decoder has been installed, and saves a call into
+ * Perl (and a copy of the payload into a temporary SV) for every document.
+ *
+ * The behavior follows JSON::XS with `allow_nonref`: the encoded form is
+ * UTF-8, hash keys are written in hash order, and true/false are decoded as
+ * the same boolean objects the JSON modules use. */
+
+#define JSON_MAXDEPTH 512
+
+typedef struct {
+    const char *cur;
+    const char *end;
+    const char *err;
+    int depth;
+    SV *sv_true;
+    SV *sv_false;
+} json_DECODER;
+
+typedef struct {
+    SV *out;
+    int depth;
+} json_ENCODER;
+
+static SV *decode_value(json_DECODER *dec);
+static void encode_sv(json_ENCODER *enc, SV *sv);
+
+/******************************************************************************
+ ** Decoding                                                                 **
+ ******************************************************************************/
+
+static void
+skip_ws(json_DECODER *dec)
+{
+    while (dec->cur < dec->end) {
+        char c = *dec->cur;
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+            break;
+        }
+        dec->cur++;
+    }
+}
+
+static int
+match_literal(json_DECODER *dec, const char *lit, size_t nlit)
+{
+    if ((size_t)(dec->end - dec->cur) < nlit || memcmp(dec->cur, lit, nlit)) {
+        return 0;
+    }
+    dec->cur += nlit;
+    return 1;
+}
+
+/* Returns a copy of the boolean object used by the JSON modules. If none of
+ * them have been loaded, plain 1 and 0 are used */
+static SV *
+decode_bool(json_DECODER *dec, int value)
+{
+    static const char *names[][2] = {
+        { "Types::Serialiser::true", "Types::Serialiser::false" },
+        { "JSON::PP::true", "JSON::PP::false" },
+        { "JSON::XS::true", "JSON::XS::false" },
+        { NULL, NULL }
+    };
+    SV **target = value ? &dec->sv_true : &dec->sv_false;
+
+    if (*target == NULL) {
+        unsigned ii;
+        for (ii = 0; names[ii][0]; ii++) {
+            SV *sv = get_sv(names[ii][value ? 0 : 1], 0);
+            if (sv && SvROK(sv)) {
+                *target = sv;
+                break;
+            }
+        }
+        if (*target == NULL) {
+            *target = value ? &PL_sv_yes : &PL_sv_no;
+        }
+    }
+    if (!SvROK(*target)) {
+        return newSViv(value);
+    }
+    return newSVsv(*target);
+}
+
+static int
+decode_hex4(json_DECODER *dec, UV *out)
+{
+    UV val = 0;
+    int ii;
+
+    if (dec->end - dec->cur < 4) {
+        return 0;
+    }
+    for (ii = 0; ii < 4; ii++) {
+        char c = dec->cur[ii];
+        val <<= 4;
+        if (c >= '0' && c <= '9') {
+            val |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            val |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            val |= c - 'A' + 10;
+        } else {
+            return 0;
+        }
+    }
+    dec->cur += 4;
+    *out = val;
+    return 1;
+}
+
+static void
+append_codepoint(SV *sv, UV cp)
+{
+    char buf[4];
+    STRLEN n;
+
+    if (cp < 0x80) {
+        buf[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        buf[0] = (char)(0xC0 | (cp >> 6));
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        buf[0] = (char)(0xE0 | (cp >> 12));
+        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        buf[0] = (char)(0xF0 | (cp >> 18));
+        buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    sv_catpvn(sv, buf, n);
+}
+
+/* Decodes a string. The opening quote has already been consumed. Strings
+ * without escapes are copied directly out of the input */
+static SV *
+decode_string(json_DECODER *dec)
+{
+    SV *sv = NULL;
+    int is_utf8 = 0;
+
+    for (;;) {
+        const char *p = dec->cur;
+        unsigned char c = 0;
+        UV cp;
+
+        while (p < dec->end) {
+            c = (unsigned char)*p;
+            if (c == '"' || c == '\\' || c < 0x20) {
+                break;
+            }
+            is_utf8 |= c & 0x80;
+            p++;
+        }
+
+        if (p == dec->end) {
+            dec->err = "unterminated string";
+            goto GT_ERR;
+        }
+        if (c < 0x20) {
+            dec->err = "invalid character in string";
+            goto GT_ERR;
+        }
+
+        if (sv == NULL) {
+            sv = newSVpvn(dec->cur, p - dec->cur);
+        } else {
+            sv_catpvn(sv, dec->cur, p - dec->cur);
+        }
+
+        dec->cur = p + 1;
+        if (c == '"') {
+            break;
+        }
+
+        /* Escape sequence */
+        if (dec->cur == dec->end) {
+            dec->err = "unterminated string";
+            goto GT_ERR;
+        }
+
+        switch (*dec->cur++) {
+        case '"': sv_catpvs(sv, "\""); break;
+        case '\\': sv_catpvs(sv, "\\"); break;
+        case '/': sv_catpvs(sv, "/"); break;
+        case 'b': sv_catpvs(sv, "\b"); break;
+        case 'f': sv_catpvs(sv, "\f"); break;
+        case 'n': sv_catpvs(sv, "\n"); break;
+        case 'r': sv_catpvs(sv, "\r"); break;
+        case 't': sv_catpvs(sv, "\t"); break;
+        case 'u':
+            if (!decode_hex4(dec, &cp)) {
+                dec->err = "invalid \\u escape";
+                goto GT_ERR;
+            }
+            if (cp >= 0xD800 && cp < 0xDC00) {
+                UV lo;
+                if (dec->end - dec->cur < 2 || dec->cur[0] != '\\' || dec->cur[1] != 'u') {
+                    dec->err = "missing low surrogate";
+                    goto GT_ERR;
+                }
+                dec->cur += 2;
+                if (!decode_hex4(dec, &lo) || lo < 0xDC00 || lo > 0xDFFF) {
+                    dec->err = "invalid low surrogate";
+                    goto GT_ERR;
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            } else if (cp >= 0xDC00 && cp < 0xE000) {
+                dec->err = "unexpected low surrogate";
+                goto GT_ERR;
+            }
+            if (cp >= 0x80) {
+                is_utf8 = 1;
+            }
+            append_codepoint(sv, cp);
+            break;
+        default:
+            dec->err = "invalid escape sequence";
+            goto GT_ERR;
+        }
+    }
+
+    if (is_utf8) {
+        SvUTF8_on(sv);
+    }
+    return sv;
+
+    GT_ERR:
+    SvREFCNT_dec(sv);
+    return NULL;
+}
+
+static SV *
+decode_number(json_DECODER *dec)
+{
+    const char *start = dec->cur, *p = dec->cur, *end = dec->end;
+    int is_float = 0, is_neg = 0;
+
+    if (*p == '-') {
+        is_neg = 1;
+        p++;
+    }
+    if (p == end || !isDIGIT(*p)) {
+        goto GT_ERR;
+    }
+    if (*p == '0') {
+        p++;
+    } else {
+        while (p < end && isDIGIT(*p)) {
+            p++;
+        }
+    }
+    if (p < end && *p == '.') {
+        is_float = 1;
+        if (++p == end || !isDIGIT(*p)) {
+            goto GT_ERR;
+        }
+        while (p < end && isDIGIT(*p)) {
+            p++;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        is_float = 1;
+        if (++p < end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+        if (p == end || !isDIGIT(*p)) {
+            goto GT_ERR;
+        }
+        while (p < end && isDIGIT(*p)) {
+            p++;
+        }
+    }
+    dec->cur = p;
+
+    if (!is_float) {
+        const char *digit = start + is_neg;
+        UV uv = 0;
+
+        for (; digit < p; digit++) {
+            UV dval = *digit - '0';
+            if (uv > (UV_MAX - dval) / 10) {
+                break;
+            }
+            uv = uv * 10 + dval;
+        }
+
+        if (digit == p) {
+            if (!is_neg) {
+                return newSVuv(uv);
+            } else if (uv <= (UV)IV_MAX) {
+                return newSViv(-(IV)uv);
+            } else if (uv == (UV)IV_MAX + 1) {
+                return newSViv(IV_MIN);
+            }
+        }
+        /* Too large for an integer. Keep it as a string rather than lose
+         * precision, as JSON::XS does */
+        return newSVpvn(start, p - start);
+    }
+
+    {
+        char buf[64];
+        size_t nbuf = p - start;
+
+        if (nbuf < sizeof buf) {
+            memcpy(buf, start, nbuf);
+            buf[nbuf] = '\0';
+            return newSVnv(Atof(buf));
+        } else {
+            SV *tmp = sv_2mortal(newSVpvn(start, nbuf));
+            return newSVnv(SvNV(tmp));
+        }
+    }
+
+    GT_ERR:
+    dec->err = "malformed number";
+    return NULL;
+}
+
+static SV *
+decode_array(json_DECODER *dec)
+{
+    AV *av = newAV();
+
+    skip_ws(dec);
+    if (dec->cur < dec->end && *dec->cur == ']') {
+        dec->cur++;
+        return newRV_noinc((SV *)av);
+    }
+
+    for (;;) {
+        SV *elem = decode_value(dec);
+        if (elem == NULL) {
+            goto GT_ERR;
+        }
+        av_push(av, elem);
+
+        skip_ws(dec);
+        if (dec->cur == dec->end) {
+            dec->err = "unterminated array";
+            goto GT_ERR;
+        }
+        if (*dec->cur == ',') {
+            dec->cur++;
+        } else if (*dec->cur == ']') {
+            dec->cur++;
+            break;
+        } else {
+            dec->err = "expected ',' or ']' in array";
+            goto GT_ERR;
+        }
+    }
+    return newRV_noinc((SV *)av);
+
+    GT_ERR:
+    SvREFCNT_dec((SV *)av);
+    return NULL;
+}
+
+static SV *
+decode_object(json_DECODER *dec)
+{
+    HV *hv = newHV();
+
+    skip_ws(dec);
+    if (dec->cur < dec->end && *dec->cur == '}') {
+        dec->cur++;
+        return newRV_noinc((SV *)hv);
+    }
+
+    for (;;) {
+        const char *key, *p;
+        int is_utf8 = 0;
+        SV *value;
+
+        skip_ws(dec);
+        if (dec->cur == dec->end || *dec->cur != '"') {
+            dec->err = "expected string for object key";
+            goto GT_ERR;
+        }
+        key = p = ++dec->cur;
+
+        /* Most keys have no escapes and can be used as-is */
+        while (p < dec->end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) {
+            is_utf8 |= *p & 0x80;
+            p++;
+        }
+
+        if (p < dec->end && *p == '"') {
+            dec->cur = p + 1;
+            skip_ws(dec);
+            if (dec->cur == dec->end || *dec->cur != ':') {
+                dec->err = "expected ':' after object key";
+                goto GT_ERR;
+            }
+            dec->cur++;
+            if ((value = decode_value(dec)) == NULL) {
+                goto GT_ERR;
+            }
+            (void)hv_store(hv, key, is_utf8 ? -(I32)(p - key) : (I32)(p - key), value, 0);
+
+        } else {
+            SV *keysv = decode_string(dec);
+            if (keysv == NULL) {
+                goto GT_ERR;
+            }
+            sv_2mortal(keysv);
+            skip_ws(dec);
+            if (dec->cur == dec->end || *dec->cur != ':') {
+                dec->err = "expected ':' after object key";
+                goto GT_ERR;
+            }
+            dec->cur++;
+            if ((value = decode_value(dec)) == NULL) {
+                goto GT_ERR;
+            }
+            (void)hv_store_ent(hv, keysv, value, 0);
+        }
+
+        skip_ws(dec);
+        if (dec->cur == dec->end) {
+            dec->err = "unterminated object";
+            goto GT_ERR;
+        }
+        if (*dec->cur == ',') {
+            dec->cur++;
+        } else if (*dec->cur == '}') {
+            dec->cur++;
+            break;
+        } else {
+            dec->err = "expected ',' or '}' in object";
+            goto GT_ERR;
+        }
+    }
+    return newRV_noinc((SV *)hv);
+
+    GT_ERR:
+    SvREFCNT_dec((SV *)hv);
+    return NULL;
+}
+
+static SV *
+decode_value(json_DECODER *dec)
+{
+    SV *ret = NULL;
+
+    skip_ws(dec);
+    if (dec->cur == dec->end) {
+        dec->err = "unexpected end of input";
+        return NULL;
+    }
+
+    switch (*dec->cur) {
+    case '{':
+    case '[':
+        if (++dec->depth > JSON_MAXDEPTH) {
+            dec->err = "nesting too deep";
+            return NULL;
+        }
+        if (*dec->cur++ == '{') {
+            ret = decode_object(dec);
+        } else {
+            ret = decode_array(dec);
+        }
+        dec->depth--;
+        return ret;
+
+    case '"':
+        dec->cur++;
+        return decode_string(dec);
+
+    case 't':
+        if (match_literal(dec, "true", 4)) {
+            return decode_bool(dec, 1);
+        }
+        break;
+
+    case 'f':
+        if (match_literal(dec, "false", 5)) {
+            return decode_bool(dec, 0);
+        }
+        break;
+
+    case 'n':
+        if (match_literal(dec, "null", 4)) {
+            return newSV(0);
+        }
+        break;
+
+    default:
+        if (*dec->cur == '-' || isDIGIT(*dec->cur)) {
+            return decode_number(dec);
+        }
+        break;
+    }
+
+    dec->err = "unexpected character";
+    return NULL;
+}
+
+/* Decodes a JSON document. Returns a new SV, or NULL if the input is not
+ * valid JSON, in which case `errp` is set to a description of the error */
+SV *
+plcb_json_decode(const char *buf, size_t len, const char **errp)
+{
+    json_DECODER dec = { NULL };
+    SV *ret;
+
+    dec.cur = buf;
+    dec.end = buf + len;
+
+    ret = decode_value(&dec);
+    if (ret) {
+        skip_ws(&dec);
+        if (dec.cur != dec.end) {
+            dec.err = "garbage after JSON value";
+            SvREFCNT_dec(ret);
+            ret = NULL;
+        }
+    }
+    if (ret == NULL) {
+        *errp = dec.err;
+    }
+    return ret;
+}
+
+/******************************************************************************
+ ** Encoding                                                                 **
+ ******************************************************************************/
+
+static void
+enc_cat(json_ENCODER *enc, const char *s, STRLEN n)
+{
+    SV *out = enc->out;
+    STRLEN cur = SvCUR(out);
+
+    if (cur + n + 1 > SvLEN(out)) {
+        STRLEN newlen = SvLEN(out) * 2;
+        if (newlen < cur + n + 1) {
+            newlen = cur + n + 1;
+        }
+        SvGROW(out, newlen);
+    }
+    Copy(s, SvPVX(out) + cur, n, char);
+    SvCUR_set(out, cur + n);
+}
+
+#define enc_cats(enc, s) enc_cat(enc, "" s "", sizeof(s) - 1)
+
+static void
+encode_string(json_ENCODER *enc, const char *s, STRLEN len, int is_utf8)
+{
+    const U8 *p = (const U8 *)s, *end = p + len, *run = p;
+
+    enc_cats(enc, "\"");
+    for (; p < end; p++) {
+        U8 c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\' && (c < 0x80 || is_utf8)) {
+            continue;
+        }
+
+        enc_cat(enc, (const char *)run, p - run);
+        run = p + 1;
+
+        if (c >= 0x80) {
+            /* Byte string; the character is Latin-1 */
+            char u8[2];
+            u8[0] = (char)(0xC0 | (c >> 6));
+            u8[1] = (char)(0x80 | (c & 0x3F));
+            enc_cat(enc, u8, 2);
+            continue;
+        }
+
+        switch (c) {
+        case '"': enc_cats(enc, "\\\""); break;
+        case '\\': enc_cats(enc, "\\\\"); break;
+        case '\b': enc_cats(enc, "\\b"); break;
+        case '\f': enc_cats(enc, "\\f"); break;
+        case '\n': enc_cats(enc, "\\n"); break;
+        case '\r': enc_cats(enc, "\\r"); break;
+        case '\t': enc_cats(enc, "\\t"); break;
+        default: {
+            static const char hex[] = "0123456789abcdef";
+            char esc[6] = { '\\', 'u', '0', '0', 0, 0 };
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xF];
+            enc_cat(enc, esc, 6);
+            break;
+        }
+        }
+    }
+    enc_cat(enc, (const char *)run, end - run);
+    enc_cats(enc, "\"");
+}
+
+static void
+encode_integer(json_ENCODER *enc, UV uv, int is_neg)
+{
+    char buf[sizeof(UV) * 3 + 2];
+    char *p = buf + sizeof buf;
+
+    do {
+        *--p = (char)('0' + uv % 10);
+        uv /= 10;
+    } while (uv);
+    if (is_neg) {
+        *--p = '-';
+    }
+    enc_cat(enc, p, buf + sizeof buf - p);
+}
+
+static void
+encode_array(json_ENCODER *enc, AV *av)
+{
+    I32 ii, last = av_len(av);
+
+    enc_cats(enc, "[");
+    for (ii = 0; ii <= last; ii++) {
+        SV **elem = av_fetch(av, ii, 0);
+        if (ii) {
+            enc_cats(enc, ",");
+        }
+        if (elem) {
+            encode_sv(enc, *elem);
+        } else {
+            enc_cats(enc, "null");
+        }
+    }
+    enc_cats(enc, "]");
+}
+
+static void
+encode_hash(json_ENCODER *enc, HV *hv)
+{
+    HE *he;
+    int first = 1;
+
+    enc_cats(enc, "{");
+    hv_iterinit(hv);
+
+    while ((he = hv_iternext(hv))) {
+        const char *key;
+        STRLEN nkey;
+        int is_utf8;
+        SV *value;
+
+        if (!first) {
+            enc_cats(enc, ",");
+        }
+        first = 0;
+
+        if (SvMAGICAL(hv) || HeKLEN(he) == HEf_SVKEY) {
+            SV *keysv = hv_iterkeysv(he);
+            key = SvPV(keysv, nkey);
+            is_utf8 = SvUTF8(keysv);
+            value = hv_iterval(hv, he);
+        } else {
+            key = HeKEY(he);
+            nkey = HeKLEN(he);
+            is_utf8 = HeKUTF8(he);
+            value = HeVAL(he);
+        }
+
+        encode_string(enc, key, nkey, is_utf8);
+        enc_cats(enc, ":");
+        encode_sv(enc, value);
+    }
+    enc_cats(enc, "}");
+}
+
+static int
+is_json_bool(SV *rv)
+{
+    return sv_derived_from(rv, "JSON::PP::Boolean") ||
+            sv_derived_from(rv, "Types::Serialiser::Boolean");
+}
+
+static void
+encode_ref(json_ENCODER *enc, SV *rv)
+{
+    SV *target = SvRV(rv);
+
+    if (SvOBJECT(target)) {
+        if (is_json_bool(rv)) {
+            if (SvTRUE(target)) {
+                enc_cats(enc, "true");
+            } else {
+                enc_cats(enc, "false");
+            }
+            return;
+        }
+        croak("Cannot encode object of class %s as JSON", HvNAME(SvSTASH(target)));
+    }
+
+    if (SvTYPE(target) == SVt_PVAV || SvTYPE(target) == SVt_PVHV) {
+        if (++enc->depth > JSON_MAXDEPTH) {
+            croak("JSON nesting too deep (is the structure cyclic?)");
+        }
+        if (SvTYPE(target) == SVt_PVAV) {
+            encode_array(enc, (AV *)target);
+        } else {
+            encode_hash(enc, (HV *)target);
+        }
+        enc->depth--;
+        return;
+    }
+
+    /* \1 and \0 are true and false */
+    if (SvTYPE(target) < SVt_PVAV && !SvROK(target)) {
+        STRLEN len;
+        const char *pv = SvPV(target, len);
+        if (len == 1 && (*pv == '1' || *pv == '0')) {
+            if (*pv == '1') {
+                enc_cats(enc, "true");
+            } else {
+                enc_cats(enc, "false");
+            }
+            return;
+        }
+    }
+    croak("Cannot encode reference to %s as JSON", sv_reftype(target, 0));
+}
+
+static void
+encode_sv(json_ENCODER *enc, SV *sv)
+{
+    SvGETMAGIC(sv);
+
+    if (SvROK(sv)) {
+        encode_ref(enc, sv);
+
+    } else if (SvPOKp(sv)) {
+        STRLEN len;
+        const char *pv = SvPV_nomg(sv, len);
+        encode_string(enc, pv, len, SvUTF8(sv));
+
+    } else if (SvNOKp(sv)) {
+        char buf[64];
+        Gconvert(SvNVX(sv), NV_DIG, 0, buf);
+        enc_cat(enc, buf, strlen(buf));
+
+    } else if (SvIOKp(sv)) {
+        if (SvIsUV(sv)) {
+            encode_integer(enc, SvUVX(sv), 0);
+        } else if (SvIVX(sv) < 0) {
+            encode_integer(enc, (UV)(-(SvIVX(sv) + 1)) + 1, 1);
+        } else {
+            encode_integer(enc, SvIVX(sv), 0);
+        }
+
+    } else if (!SvOK(sv)) {
+        enc_cats(enc, "null");
+
+    } else {
+        croak("Cannot encode value of type %s as JSON", sv_reftype(sv, 0));
+    }
+}
+
+/* Largest initial buffer taken from the previous document. Larger documents
+ * grow the buffer geometrically */
+#define JSON_ENCSIZE_MAX 4096
+
+/* Encodes a value as JSON. The output buffer starts at the size of the
+ * previous document (up to JSON_ENCSIZE_MAX), so that it rarely needs to
+ * grow. Croaks if the value cannot be encoded */
+SV *
+plcb_json_encode(PLCB_t *object, SV *value)
+{
+    json_ENCODER enc = { NULL };
+    STRLEN hint = object->json_encsize;
+
+    if (hint > JSON_ENCSIZE_MAX) {
+        hint = JSON_ENCSIZE_MAX;
+    }
+
+    /* Mortal until done, so it isn't leaked if we croak */
+    enc.out = sv_2mortal(newSV(hint + 16));
+    SvPOK_only(enc.out);
+    SvCUR_set(enc.out, 0);
+
+    encode_sv(&enc, value);
+    *SvEND(enc.out) = '\0';
+    object->json_encsize = SvCUR(enc.out);
+
+    /* The value may be held for a while (e.g. by a multi store), so don't
+     * keep more than a quarter of it unused */
+    if (SvLEN(enc.out) - SvCUR(enc.out) > 256 &&
+            SvLEN(enc.out) - SvCUR(enc.out) > SvLEN(enc.out) / 4) {
+        SvPV_renew(enc.out, SvCUR(enc.out) + 1);
+    }
+
+    SvREFCNT_inc(enc.out);
+    return enc.out;
+}
@@ -1,26 +1,36 @@
 #include "perl-couchbase.h"
 
+/* Creates a new context. Implicit contexts become the bucket's current
+ * context while their operation is scheduled. Batch contexts are not tied to
+ * the bucket, so any number of them may be open or in flight at once */
 SV *
 plcb_opctx_new(PLCB_t *parent, int flags)
 {
     plcb_OPCTX *ctx;
-    SV *blessed;
+    SV *blessed = NULL;
 
-    if (parent->curctx) {
-        ctx = NUM2PTR(plcb_OPCTX*,SvIVX(SvRV(parent->curctx)));
-        if (ctx->nremaining == 0) {
-            plcb_opctx_clear(parent);
-        } else {
-            die("Existing context found. Existing context must be waited for or cleared");
-        }
+    /* Only single operations join the pending auto-batch */
+    if (!(flags & PLCB_OPCTXf_SINGLE)) {
+        plcb_autobatch_flush(parent);
     }
 
-    if (parent->cachectx && (flags & PLCB_OPCTXf_IMPLICIT)) {
-        blessed = parent->cachectx;
-        parent->cachectx = NULL;
-        ctx = NUM2PTR(plcb_OPCTX*,SvIVX(SvRV(blessed)));
+    if (flags & PLCB_OPCTXf_IMPLICIT) {
+        if (parent->curctx) {
+            ctx = NUM2PTR(plcb_OPCTX*,SvIVX(SvRV(parent->curctx)));
+            if (ctx->nremaining == 0) {
+                plcb_opctx_clear(parent);
+            } else {
+                die("Existing context found. Existing context must be waited for or cleared");
+            }
+        }
+        if (parent->cachectx) {
+            blessed = parent->cachectx;
+            parent->cachectx = NULL;
+            ctx = NUM2PTR(plcb_OPCTX*,SvIVX(SvRV(blessed)));
+        }
+    }
 
-    } else {
+    if (blessed == NULL) {
         Newxz(ctx, 1, plcb_OPCTX);
         ctx->docs = newHV();
         ctx->parent = newRV_inc(parent->selfobj);
@@ -32,12 +42,35 @@ plcb_opctx_new(PLCB_t *parent, int flags)
 
     ctx->flags = flags;
     ctx->nremaining = 0;
-    parent->curctx = blessed;
-    SvREFCNT_inc(parent->curctx);
+    ctx->keyslot.docav = NULL;
+    if (flags & PLCB_OPCTXf_IMPLICIT) {
+        ctx->keyslot.ctxrv = blessed;
+        parent->curctx = blessed;
+        SvREFCNT_inc(parent->curctx);
+    } else {
+        ctx->keyslot.ctxrv = NULL; /* Set by plcb_opctx_hold() */
+    }
     lcb_sched_enter(parent->instance);
     return blessed;
 }
 
+/* Releases everything the context holds for its current operations. Any
+ * responses still outstanding for them will be discarded */
+void
+plcb_opctx_reset(PLCB_t *parent, plcb_OPCTX *ctx)
+{
+    hv_clear(ctx->docs);
+    parent->npending -= ctx->nremaining;
+    parent->inflight.nbytes -= plcb_opctx_release_slots(ctx);
+    ctx->nremaining = 0;
+    plcb_opctx_release_durability(ctx);
+
+    if (ctx->multi) {
+        ctx->multi->fail(ctx->multi);
+        ctx->multi = NULL;
+    }
+}
+
 void
 plcb_opctx_clear(PLCB_t *parent)
 {
@@ -52,12 +85,13 @@ plcb_opctx_clear(PLCB_t *parent)
     }
 
     ctx = NUM2PTR(plcb_OPCTX*,SvIVX(SvRV(parent->curctx)));
-    hv_clear(ctx->docs);
+    plcb_opctx_reset(parent, ctx);
 
-    if (ctx->multi) {
-        ctx->multi->fail(ctx->multi);
-        ctx->multi = NULL;
-    }
+    /* Documents not yet decoded remain lazy, and decode when accessed */
+    SvREFCNT_dec(ctx->deferred);
+    SvREFCNT_dec(ctx->decode_many);
+    ctx->deferred = NULL;
+    ctx->decode_many = NULL;
 
     if ((ctx->flags & PLCB_OPCTXf_IMPLICIT) && parent->cachectx == NULL) {
         parent->cachectx = parent->curctx;
@@ -67,12 +101,94 @@ plcb_opctx_clear(PLCB_t *parent)
     parent->curctx = NULL;
 }
 
+/* Returns the reference used by the operations of the batch context
+ * `ctxsv`. If the context has nothing outstanding this is `ctxsv` itself,
+ * and plcb_opctx_return() replaces it once the operation is scheduled. An
+ * operation which croaks before then leaves the context unreferenced */
+SV *
+plcb_opctx_hold(PLCB_t *parent, SV *ctxsv)
+{
+    plcb_OPCTX *ctx;
+
+    if (!sv_isa(ctxsv, PLCB_OPCTX_CLASSNAME)) {
+        die("Not a valid " PLCB_OPCTX_CLASSNAME);
+    }
+    ctx = NUM2PTR(plcb_OPCTX*, SvIV(SvRV(ctxsv)));
+    if (!SvROK(ctx->parent) || SvRV(ctx->parent) != parent->selfobj) {
+        die("Context belongs to a different bucket");
+    }
+    if (ctx->flags & PLCB_OPCTXf_IMPLICIT) {
+        die("Operations may only be added to contexts created by batch()");
+    }
+
+    /* A previous submit may have left the scheduling context */
+    lcb_sched_enter(parent->instance);
+    return ctx->selfrv ? ctx->selfrv : ctxsv;
+}
+
+/* Takes the reference which keeps a batch context alive while its operations
+ * are outstanding, once the first of them was scheduled. It is released by
+ * plcb_opctx_finish() */
+static void
+opctx_take_self(plcb_SINGLEOP *so, plcb_OPCTX *ctx)
+{
+    ctx->selfrv = newRV_inc(SvRV(so->opctx));
+    ctx->keyslot.ctxrv = ctx->selfrv;
+    if (so->cookie != &ctx->keyslot) {
+        so->cookie->ctxrv = ctx->selfrv;
+    }
+    so->opctx = ctx->selfrv;
+}
+
+/* Called once every operation in the context has completed. This releases
+ * the reference taken when the operations were scheduled, and may free the
+ * context */
+void
+plcb_opctx_finish(PLCB_t *parent, SV *ctxrv)
+{
+    plcb_OPCTX *ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(ctxrv)));
+
+    if (ctxrv == parent->curctx) {
+        SvREFCNT_dec(ctxrv);
+        plcb_opctx_clear(parent);
+        return;
+    }
+
+    /* Deferred values are kept for wait_all() */
+    plcb_opctx_reset(parent, ctx);
+    if (ctxrv == ctx->selfrv) {
+        ctx->selfrv = NULL;
+        ctx->keyslot.ctxrv = NULL;
+    }
+    SvREFCNT_dec(ctxrv);
+}
+
+/* Runs the event loop until the batch context has no operations
+ * outstanding or, if `one` is set, until one of them has completed. Other
+ * contexts sharing the instance make progress meanwhile */
 void
+plcb_opctx_wait(PLCB_t *parent, plcb_OPCTX *ctx, int one)
+{
+    plcb_opctx_submit(parent, ctx);
+    while (ctx->nremaining) {
+        if (one && av_len(ctx->u.ctxqueue) >= 0) {
+            break;
+        }
+        plcb_kv_wait(parent);
+    }
+}
+
+/* Returns false if the operation was rejected by the in-flight limits, in
+ * which case nothing was set up and the document's error is set */
+int
 plcb_opctx_initop(plcb_SINGLEOP *so, PLCB_t *parent, SV *doc, SV *ctx, SV *options)
 {
     if (!plcb_doc_isa(parent, doc)) {
         die("Must pass a " PLCB_RET_CLASSNAME);
     }
+    if (!plcb_inflight_admit(parent, (AV *)SvRV(doc))) {
+        return 0;
+    }
 
     so->docrv = doc;
     so->docav = (AV *)SvRV(doc);
@@ -90,18 +206,232 @@ plcb_opctx_initop(plcb_SINGLEOP *so, PLCB_t *parent, SV *doc, SV *ctx, SV *optio
     }
 
     if (ctx && SvTYPE(ctx) != SVt_NULL) {
-        if (SvRV(so->opctx) != SvRV(parent->curctx)) {
-            die("Got a different context than current!");
-        }
-        so->opctx = parent->curctx;
+        so->opctx = plcb_opctx_hold(parent, ctx);
     } else {
-        so->opctx = plcb_opctx_new(parent, PLCB_OPCTXf_IMPLICIT);
+        so->opctx = plcb_opctx_new(parent, PLCB_OPCTXf_IMPLICIT|PLCB_OPCTXf_SINGLE);
         /* If we get an error, don't leave the pointer dangling */
         SAVEFREESV(so->opctx);
     }
 
-    so->cookie = so->opctx;
     so->ctxptr = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(so->opctx)));
+    if (so->cmdbase == PLCB_CMD_ENDURE) {
+        so->cookie = &so->ctxptr->keyslot;
+    } else {
+        so->cookie = plcb_opctx_newslot(so->opctx, so->docav);
+    }
+    return 1;
+}
+
+/* Allocates a new cookie for an operation on `docav` within the context.
+ * The slot holds a reference to the document until the operation completes
+ * or the context is cleared */
+plcb_OPSLOT *
+plcb_opctx_newslot(SV *ctxrv, AV *docav)
+{
+    plcb_OPCTX *ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(ctxrv)));
+    plcb_OPSLOT *slot;
+
+    if (ctx->slots == NULL || ctx->nslots == PLCB_OPSLOT_BLOCKSIZE) {
+        plcb_OPSLOTBLOCK *block;
+        Newx(block, 1, plcb_OPSLOTBLOCK);
+        block->next = ctx->slots;
+        ctx->slots = block;
+        ctx->nslots = 0;
+    }
+
+    slot = ctx->slots->slots + ctx->nslots++;
+    slot->ctxrv = ctxrv;
+    slot->docav = docav;
+    slot->flags = 0;
+    slot->nbytes = 0;
+    SvREFCNT_inc((SV *)docav);
+    return slot;
+}
+
+/* Drops any documents still held by the slots. The most recent block is
+ * retained so that a cached context does not need to allocate again.
+ * Returns the in-flight bytes of operations which never got a response */
+size_t
+plcb_opctx_release_slots(plcb_OPCTX *ctx)
+{
+    plcb_OPSLOTBLOCK *block = ctx->slots;
+    unsigned ii, nused = ctx->nslots;
+    size_t nbytes = 0;
+
+    while (block) {
+        plcb_OPSLOTBLOCK *next = block->next;
+        for (ii = 0; ii < nused; ii++) {
+            SvREFCNT_dec((SV *)block->slots[ii].docav);
+            block->slots[ii].docav = NULL;
+            nbytes += block->slots[ii].nbytes;
+            block->slots[ii].nbytes = 0;
+        }
+        if (block != ctx->slots) {
+            Safefree(block);
+        }
+        nused = PLCB_OPSLOT_BLOCKSIZE;
+        block = next;
+    }
+
+    if (ctx->slots) {
+        ctx->slots->next = NULL;
+    }
+    ctx->nslots = 0;
+    return nbytes;
+}
+
+/* Discards any durability groups which were never submitted */
+void
+plcb_opctx_release_durability(plcb_OPCTX *ctx)
+{
+    while (ctx->durgroups) {
+        plcb_DURGROUP *group = ctx->durgroups;
+        ctx->durgroups = group->next;
+        group->mctx->fail(group->mctx);
+        SvREFCNT_dec(group->docs);
+        Safefree(group);
+    }
+    ctx->ndurable = 0;
+}
+
+/* Decodes the values whose decoding was deferred with the `decode` option
+ * to batch(). Called once the context has been waited for */
+void
+plcb_opctx_decode_deferred(PLCB_t *parent, plcb_OPCTX *ctx)
+{
+    AV *docs = ctx->deferred;
+
+    if (docs == NULL) {
+        return;
+    }
+    ctx->deferred = NULL;
+    sv_2mortal((SV *)docs);
+    plcb_doc_inflate_many(parent, docs, ctx->decode_many);
+}
+
+static void
+autobatch_timer_callback(lcb_timer_t timer, lcb_t instance, const void *cookie)
+{
+    (void)timer; (void)instance;
+    plcb_autobatch_flush((PLCB_t *)cookie);
+}
+
+/* Adds a scheduled operation to the pending batch, flushing it if a limit
+ * was reached. Otherwise the timer is armed, if it isn't already */
+static void
+autobatch_add(PLCB_t *parent, size_t nbytes)
+{
+    plcb_AUTOBATCH *ab = &parent->autobatch;
+    lcb_error_t err = LCB_SUCCESS;
+
+    ab->nops++;
+    ab->nbytes += nbytes;
+    if (ab->nops >= ab->maxops || (ab->maxbytes && ab->nbytes >= ab->maxbytes)) {
+        plcb_autobatch_flush(parent);
+        return;
+    }
+
+    if (ab->timer == NULL) {
+        ab->timer = lcb_timer_create(parent->instance, parent, ab->delay, 0,
+            autobatch_timer_callback, &err);
+        if (ab->timer == NULL) {
+            warn("Couldn't create batching timer: 0x%x (%s)", err, lcb_strerror(NULL, err));
+            plcb_autobatch_flush(parent);
+        }
+    }
+}
+
+/* Submits any operations pending in the auto-batch. This must be called
+ * before anything else enters or fails the scheduling context */
+void
+plcb_autobatch_flush(PLCB_t *parent)
+{
+    plcb_AUTOBATCH *ab = &parent->autobatch;
+
+    if (ab->timer) {
+        lcb_timer_destroy(parent->instance, ab->timer);
+        ab->timer = NULL;
+    }
+    if (ab->nops == 0) {
+        return;
+    }
+    ab->nops = 0;
+    ab->nbytes = 0;
+    plcb_sched_leave(parent);
+}
+
+void
+plcb_autobatch_configure(PLCB_t *parent, unsigned maxops, size_t maxbytes, lcb_U32 delay)
+{
+    plcb_autobatch_flush(parent);
+    parent->autobatch.maxops = maxops;
+    parent->autobatch.maxbytes = maxbytes;
+    parent->autobatch.delay = delay;
+}
+
+static int
+inflight_full(PLCB_t *parent)
+{
+    plcb_INFLIGHT *inf = &parent->inflight;
+    return (inf->maxops && (unsigned)parent->npending >= inf->maxops) ||
+        (inf->maxbytes && inf->nbytes >= inf->maxbytes);
+}
+
+/* Checks the in-flight limits before an operation for `docav` is scheduled.
+ * If they were reached the document fails with LCB_EBUSY, and false is
+ * returned */
+int
+plcb_inflight_admit(PLCB_t *parent, AV *docav)
+{
+    if (!inflight_full(parent)) {
+        return 1;
+    }
+    plcb_doc_set_err(parent, docav, LCB_EBUSY);
+    parent->inflight.nrejected++;
+    parent->inflight.rejecting = 1;
+    return 0;
+}
+
+/* Accounts for an operation which was scheduled. The bytes are released by
+ * the first response for the slot, and the operation itself by complete_doc() */
+void
+plcb_inflight_add(PLCB_t *parent, plcb_OPSLOT *slot, size_t nbytes)
+{
+    parent->npending++;
+    parent->nqueued++;
+    if (slot) {
+        slot->nbytes = nbytes;
+        parent->inflight.nbytes += nbytes;
+    }
+}
+
+/* Called after an operation completed. If operations were rejected since
+ * the last call, the drain callback is invoked once the limits allow more */
+void
+plcb_inflight_drain(PLCB_t *parent)
+{
+    plcb_INFLIGHT *inf = &parent->inflight;
+    dSP;
+
+    if (!inf->rejecting || inflight_full(parent)) {
+        return;
+    }
+    inf->rejecting = 0;
+    if (inf->on_drain == NULL) {
+        return;
+    }
+
+    /* Called from a response callback, so an exception must not unwind
+     * through the library */
+    ENTER;
+    SAVETMPS;
+    PUSHMARK(SP);
+    call_sv(inf->on_drain, G_DISCARD|G_NOARGS|G_EVAL);
+    if (SvTRUE(ERRSV)) {
+        warn("Drain callback failed: %s", SvPV_nolen(ERRSV));
+    }
+    FREETMPS;
+    LEAVE;
 }
 
 SV *
@@ -110,15 +440,14 @@ plcb_opctx_return(plcb_SINGLEOP *so, lcb_error_t err)
     /* Figure out what type of context we are */
     int haserr = 0;
     SV *retval;
-    SV *ksv;
-    HE *ent;
     plcb_OPCTX *ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(so->opctx)));
 
     if (err != LCB_SUCCESS) {
         plcb_doc_set_err(so->parent, so->docav, err);
 
+        /* Nothing was scheduled for this operation */
         if (ctx->flags & PLCB_OPCTXf_IMPLICIT) {
-            lcb_sched_fail(so->parent->instance);
+            plcb_sched_fail(so->parent);
         }
 
         warn("Couldn't schedule operation. Code 0x%x (%s)\n", err, lcb_strerror(NULL, err));
@@ -126,28 +455,34 @@ plcb_opctx_return(plcb_SINGLEOP *so, lcb_error_t err)
         goto GT_RET;
     }
 
-    /* Get the key */
-    if (so->cmdbase == PLCB_CMD_STATS || so->cmdbase == PLCB_CMD_OBSERVE ||
-            so->cmdbase == PLCB_CMD_HTTP) {
-        ksv = &PL_sv_yes;
-    } else {
-        ksv = *av_fetch(so->docav, PLCB_RETIDX_KEY, 1);
-    }
-
-    ent = hv_fetch_ent(ctx->docs, ksv, 1, 0);
-    if (SvOK(HeVAL(ent))) {
-        die("Found duplicate item inside batch context");
-    } else {
+    /* Operations added to a multi context all share a single cookie, and
+     * are matched to their documents by key */
+    if (so->cookie == &ctx->keyslot) {
+        SV *ksv = *av_fetch(so->docav, PLCB_RETIDX_KEY, 1);
+        HE *ent = hv_fetch_ent(ctx->docs, ksv, 1, 0);
+        if (SvOK(HeVAL(ent))) {
+            die("Found duplicate item inside durability context");
+        }
         SvREFCNT_dec(HeVAL(ent));
         HeVAL(ent) = newRV_inc((SV*)so->docav);
     }
 
+    if (ctx->selfrv == NULL && (ctx->flags & PLCB_OPCTXf_IMPLICIT) == 0) {
+        opctx_take_self(so, ctx);
+    }
+
     /* Increment remaining count on the context */
     ctx->nremaining++;
+    plcb_inflight_add(so->parent,
+        so->cookie == &ctx->keyslot ? NULL : so->cookie, so->nbytes);
 
     if (ctx->flags & PLCB_OPCTXf_IMPLICIT) {
         SvREFCNT_inc(so->opctx); /* Undo SAVEFREESV */
-        lcb_sched_leave(so->parent->instance);
+        if (so->parent->async && so->parent->autobatch.maxops) {
+            autobatch_add(so->parent, so->nbytes);
+        } else {
+            plcb_sched_leave(so->parent);
+        }
 
         if (so->parent->async) {
             /* Clear this context right now */
@@ -155,7 +490,10 @@ plcb_opctx_return(plcb_SINGLEOP *so, lcb_error_t err)
             so->parent->curctx = NULL;
             goto GT_RET;
         }
-        plcb_kv_wait(so->parent);
+        /* Operations of other contexts may complete first */
+        while (ctx->nremaining) {
+            plcb_kv_wait(so->parent);
+        }
         /* See if we have an error */
         if (plcb_doc_get_err(so->docav) != LCB_SUCCESS) {
             haserr = 1;
@@ -174,17 +512,53 @@ plcb_opctx_return(plcb_SINGLEOP *so, lcb_error_t err)
     return retval;
 }
 
+/* Completes an implicit operation whose result was available without
+ * contacting the server. Nothing was scheduled, so the context is discarded */
+SV *
+plcb_opctx_return_local(plcb_SINGLEOP *so)
+{
+    SV *retval;
+
+    plcb_sched_fail(so->parent);
+    plcb_opctx_clear(so->parent);
+
+    if (plcb_doc_get_err(so->docav) == LCB_SUCCESS) {
+        retval = &PL_sv_yes;
+    } else {
+        retval = &PL_sv_no;
+    }
+    SvREFCNT_inc(retval);
+    return retval;
+}
 
 void
 plcb_opctx_submit(PLCB_t *parent, plcb_OPCTX *ctx)
 {
     lcb_error_t err = LCB_SUCCESS;
     if (ctx->multi) {
-        err = ctx->multi->done(ctx->multi, parent->curctx);
+        err = ctx->multi->done(ctx->multi, &ctx->keyslot);
         ctx->multi = NULL;
         if (err != LCB_SUCCESS) {
             die("Couldn't submit multi context: Code=0x%x", err);
         }
     }
+    plcb_sched_leave(parent);
+}
+
+/* The library has a single scheduling context, shared by every context of
+ * the bucket. Leaving it submits the operations of all of them, so it may
+ * only be failed when nothing else was queued */
+void
+plcb_sched_leave(PLCB_t *parent)
+{
+    parent->nqueued = 0;
     lcb_sched_leave(parent->instance);
 }
+
+void
+plcb_sched_fail(PLCB_t *parent)
+{
+    if (parent->nqueued == 0) {
+        lcb_sched_fail(parent->instance);
+    }
+}
@@ -33,6 +33,68 @@ key_from_so(plcb_SINGLEOP *so, lcb_CMDBASE *cmd)
     }
 
     LCB_CMD_SET_KEY(cmd, key, nkey);
+    so->nbytes = nkey;
+}
+
+static void
+hedge_timer_callback(lcb_timer_t timer, lcb_t instance, const void *cookie)
+{
+    PLCB_t *parent = (PLCB_t *)lcb_get_cookie(instance);
+    plcb_HEDGE *hedge = (plcb_HEDGE *)cookie;
+    lcb_CMDGETREPLICA rcmd = { 0 };
+    const char *key;
+    STRLEN nkey;
+    lcb_error_t err;
+
+    lcb_timer_destroy(instance, timer);
+    hedge->timer = NULL;
+
+    key = SvPV(*av_fetch(hedge->slot.docav, PLCB_RETIDX_KEY, 1), nkey);
+    LCB_CMD_SET_KEY(&rcmd, key, nkey);
+    rcmd.strategy = LCB_REPLICA_FIRST;
+
+    plcb_autobatch_flush(parent);
+    lcb_sched_enter(instance);
+    err = lcb_rget3(instance, &hedge->slot, &rcmd);
+    if (err == LCB_SUCCESS) {
+        hedge->npending++;
+        parent->nhedged++;
+        plcb_sched_leave(parent);
+    } else {
+        plcb_sched_fail(parent);
+    }
+}
+
+/* Called when the hedged operation has been completed, so the timer no longer
+ * holds the event loop */
+void
+plcb_hedge_cancel(PLCB_t *object, plcb_HEDGE *hedge)
+{
+    if (hedge->timer) {
+        lcb_timer_destroy(object->instance, hedge->timer);
+        hedge->timer = NULL;
+    }
+}
+
+/* Moves the operation's slot into a new plcb_HEDGE and arms its timer */
+static void
+hedge_setup(PLCB_t *object, plcb_SINGLEOP *opinfo, lcb_U32 hedge_us)
+{
+    plcb_HEDGE *hedge;
+    lcb_error_t err = LCB_SUCCESS;
+
+    Newxz(hedge, 1, plcb_HEDGE);
+    hedge->slot = *opinfo->cookie;
+    hedge->slot.flags |= PLCB_OPSLOTf_HEDGE;
+    hedge->npending = 1;
+    opinfo->cookie->docav = NULL; /* Reference now owned by the hedge */
+    opinfo->cookie = &hedge->slot;
+
+    hedge->timer = lcb_timer_create(object->instance, hedge, hedge_us, 0,
+        hedge_timer_callback, &err);
+    if (hedge->timer == NULL) {
+        warn("Couldn't create hedge timer: 0x%x (%s)", err, lcb_strerror(NULL, err));
+    }
 }
 
 SV *
@@ -40,13 +102,39 @@ PLCB_op_get(PLCB_t *object, plcb_SINGLEOP *opinfo)
 {
     lcb_error_t err = LCB_SUCCESS;
     lcb_CMDGET gcmd = { 0 };
+    lcb_U32 hedge_us = 0;
 
-    PLCB_args_get(object, opinfo, &gcmd);
+    PLCB_args_get(object, opinfo, &gcmd, &hedge_us);
     key_from_so(opinfo, (lcb_CMDBASE*)&gcmd);
+
+    /* The caches can only satisfy synchronous, standalone gets */
+    if (opinfo->cmdbase == PLCB_CMD_GET && !object->async &&
+            (opinfo->ctxptr->flags & PLCB_OPCTXf_IMPLICIT)) {
+        const char *key = gcmd.key.contig.bytes;
+        size_t nkey = gcmd.key.contig.nbytes;
+
+        if (object->negcache && plcb_negcache_check(object, key, nkey)) {
+            plcb_doc_set_err(object, opinfo->docav, LCB_KEY_ENOENT);
+            return plcb_opctx_return_local(opinfo);
+        }
+        if (object->cache && plcb_cache_fill(object, opinfo->docav, key, nkey)) {
+            return plcb_opctx_return_local(opinfo);
+        }
+    }
+
     if (opinfo->cmdbase == PLCB_CMD_TOUCH) {
         err = lcb_touch3(object->instance, opinfo->cookie, (lcb_CMDTOUCH*)&gcmd);
     } else {
+        if (hedge_us) {
+            hedge_setup(object, opinfo, hedge_us);
+        }
         err = lcb_get3(object->instance, opinfo->cookie, &gcmd);
+        if (err != LCB_SUCCESS && hedge_us) {
+            plcb_HEDGE *hedge = (plcb_HEDGE *)opinfo->cookie;
+            plcb_hedge_cancel(object, hedge);
+            SvREFCNT_dec((SV *)hedge->slot.docav);
+            Safefree(hedge);
+        }
     }
     return plcb_opctx_return(opinfo, err);
 }
@@ -67,6 +155,11 @@ PLCB_op_set(PLCB_t *object, plcb_SINGLEOP *opinfo)
     }
 
     LCB_CMD_SET_VALUE(&scmd, vspec.encoded, vspec.len);
+    opinfo->nbytes += vspec.len;
+
+    if (object->negcache) {
+        plcb_negcache_remove(object, scmd.key.contig.bytes, scmd.key.contig.nbytes);
+    }
 
     if (opinfo->cmdbase != PLCB_CMD_APPEND && opinfo->cmdbase != PLCB_CMD_PREPEND) {
         scmd.flags = vspec.flags;
@@ -86,6 +179,9 @@ PLCB_op_counter(PLCB_t *object, plcb_SINGLEOP *opinfo)
     
     key_from_so(opinfo, (lcb_CMDBASE *)&ccmd);
     PLCB_args_arithmetic(object, opinfo, &ccmd);
+    if (object->negcache) {
+        plcb_negcache_remove(object, ccmd.key.contig.bytes, ccmd.key.contig.nbytes);
+    }
     err = lcb_counter3(object->instance, opinfo->cookie, &ccmd);
     return plcb_opctx_return(opinfo, err);
 }
@@ -160,6 +256,7 @@ SV*
 PLCB_op_endure(PLCB_t *object, plcb_SINGLEOP *opinfo)
 {
     lcb_CMDENDURE ecmd = { 0 };
+    lcb_MUTATION_TOKEN token = { 0 };
     lcb_error_t err;
     lcb_MULTICMD_CTX *mctx = opinfo->ctxptr->multi;
 
@@ -169,6 +266,11 @@ PLCB_op_endure(PLCB_t *object, plcb_SINGLEOP *opinfo)
 
     key_from_so(opinfo, (lcb_CMDBASE*)&ecmd);
     PLCB_args_endure(object, opinfo, (lcb_CMDBASE*)&ecmd);
+    if (object->durmode == LCB_DURABILITY_MODE_SEQNO &&
+            plcb_doc_get_token(opinfo->docav, &token)) {
+        ecmd.mutation_token = &token;
+        ecmd.cmdflags |= LCB_CMDENDURE_F_MUTATION_TOKEN;
+    }
     err = mctx->addcmd(mctx, (lcb_CMDBASE*)&ecmd);
     return plcb_opctx_return(opinfo, err);
 }
@@ -184,3 +286,343 @@ PLCB_op_http(PLCB_t *object, plcb_SINGLEOP *opinfo)
     err = lcb_http3(object->instance, opinfo->cookie, &htcmd);
     return plcb_opctx_return(opinfo, err);
 }
+
+SV*
+PLCB_op_get_replica(PLCB_t *object, plcb_SINGLEOP *opinfo)
+{
+    lcb_CMDGETREPLICA rcmd = { 0 };
+    lcb_error_t err;
+
+    key_from_so(opinfo, (lcb_CMDBASE*)&rcmd);
+    PLCB_args_get_replica(object, opinfo, &rcmd);
+    err = lcb_rget3(object->instance, opinfo->cookie, &rcmd);
+    return plcb_opctx_return(opinfo, err);
+}
+
+SV*
+PLCB_op_subdoc(PLCB_t *object, plcb_SINGLEOP *opinfo)
+{
+    lcb_CMDSUBDOC sdcmd = { 0 };
+    lcb_error_t err;
+    SV *specs;
+
+    key_from_so(opinfo, (lcb_CMDBASE*)&sdcmd);
+    specs = PLCB_args_subdoc(object, opinfo, &sdcmd);
+
+    /* The response does not contain the paths; keep the spec list inside the
+     * document until the callback replaces it with the results */
+    av_store(opinfo->docav, PLCB_RETIDX_VALUE, specs);
+    plcb_doc_clear_lazy(opinfo->docav);
+
+    err = lcb_subdoc3(object->instance, opinfo->cookie, &sdcmd);
+    if (err != LCB_SUCCESS) {
+        av_store(opinfo->docav, PLCB_RETIDX_VALUE, newSV(0));
+    }
+    return plcb_opctx_return(opinfo, err);
+}
+
+/* Calls the operation function for the command in `opinfo` */
+SV *
+PLCB_op_dispatch(PLCB_t *object, plcb_SINGLEOP *opinfo)
+{
+    switch (opinfo->cmdbase) {
+    case PLCB_CMD_GET:
+    case PLCB_CMD_GAT:
+    case PLCB_CMD_TOUCH:
+    case PLCB_CMD_LOCK:
+        return PLCB_op_get(object, opinfo);
+    case PLCB_CMD_SET:
+    case PLCB_CMD_ADD:
+    case PLCB_CMD_REPLACE:
+    case PLCB_CMD_APPEND:
+    case PLCB_CMD_PREPEND:
+        return PLCB_op_set(object, opinfo);
+    case PLCB_CMD_COUNTER:
+        return PLCB_op_counter(object, opinfo);
+    case PLCB_CMD_REMOVE:
+        return PLCB_op_remove(object, opinfo);
+    case PLCB_CMD_UNLOCK:
+        return PLCB_op_unlock(object, opinfo);
+    case PLCB_CMD_STATS:
+    case PLCB_CMD_KEYSTATS:
+        return PLCB_op_stats(object, opinfo);
+    case PLCB_CMD_OBSERVE:
+        return PLCB_op_observe(object, opinfo);
+    case PLCB_CMD_ENDURE:
+        return PLCB_op_endure(object, opinfo);
+    case PLCB_CMD_HTTP:
+        return PLCB_op_http(object, opinfo);
+    case PLCB_CMD_GETREPLICA:
+        return PLCB_op_get_replica(object, opinfo);
+    case PLCB_CMD_LOOKUP_IN:
+    case PLCB_CMD_MUTATE_IN:
+        return PLCB_op_subdoc(object, opinfo);
+    default:
+        die("Unknown command %d", opinfo->cmdbase);
+        return NULL;
+    }
+}
+
+static lcb_error_t
+multi_schedule(PLCB_t *object, int cmdbase, const void *cookie, lcb_CMDBASE *cmd)
+{
+    switch (cmdbase) {
+    case PLCB_CMD_GET:
+    case PLCB_CMD_GAT:
+        return lcb_get3(object->instance, cookie, (lcb_CMDGET *)cmd);
+    case PLCB_CMD_TOUCH:
+        return lcb_touch3(object->instance, cookie, (lcb_CMDTOUCH *)cmd);
+    case PLCB_CMD_REMOVE:
+        return lcb_remove3(object->instance, cookie, (lcb_CMDREMOVE *)cmd);
+    case PLCB_CMD_COUNTER:
+        return lcb_counter3(object->instance, cookie, (lcb_CMDCOUNTER *)cmd);
+    default:
+        abort();
+        return LCB_EINVAL;
+    }
+}
+
+/* Creates a new document for a multi operation and places it inside the
+ * results hash. Returns NULL if the ID was already seen */
+static AV *
+multi_newdoc(PLCB_t *object, HV *results, SV *idsv)
+{
+    AV *docav;
+    HE *ent;
+    const char *key;
+    STRLEN nkey = 0;
+
+    if (SvOK(idsv) == 0) {
+        die("IDs must not be undef");
+    }
+
+    ent = hv_fetch_ent(results, idsv, 1, 0);
+    if (SvOK(HeVAL(ent))) {
+        return NULL;
+    }
+
+    key = SvPV(idsv, nkey);
+    docav = newAV();
+    av_store(docav, PLCB_RETIDX_KEY, newSVpvn_flags(key, nkey, SvUTF8(idsv)));
+    av_store(docav, PLCB_RETIDX_FMTSPEC, newSVuv(PLCB_CF_JSON));
+    SvREFCNT_dec(HeVAL(ent));
+    HeVAL(ent) = plcb_ret_blessed_rv(object, docav);
+    plcb_doc_set_err(object, docav, nkey ? -1 : LCB_EMPTY_KEY);
+    return docav;
+}
+
+/* Called once the command for the document has been scheduled */
+static void
+multi_adddoc(PLCB_t *object, plcb_OPCTX *ctx, AV *docav, plcb_OPSLOT *slot,
+    size_t nbytes, lcb_error_t err)
+{
+    if (err != LCB_SUCCESS) {
+        plcb_doc_set_err(object, docav, err);
+        return;
+    }
+    ctx->nremaining++;
+    plcb_inflight_add(object, slot, nbytes);
+}
+
+/* Submits the context and waits for the results in synchronous mode. In
+ * asynchronous mode the context is returned. */
+static SV *
+multi_finish(PLCB_t *object, SV *ctxrv, plcb_OPCTX *ctx, HV *results)
+{
+    if (!ctx->nremaining) {
+        plcb_sched_fail(object);
+        plcb_opctx_clear(object);
+        return newRV_inc((SV *)results);
+    }
+
+    SvREFCNT_inc(ctxrv); /* Undo SAVEFREESV */
+    plcb_sched_leave(object);
+
+    if (object->async) {
+        SvREFCNT_dec(object->curctx);
+        object->curctx = NULL;
+        SvREFCNT_inc(ctxrv);
+        return ctxrv;
+    }
+
+    while (ctx->nremaining) {
+        plcb_kv_wait(object);
+    }
+    return newRV_inc((SV *)results);
+}
+
+/* Schedules the same command for each ID in the `ids` array, inside a single
+ * implicit context. Documents are created here directly rather than being
+ * passed in, and the options are only parsed once for the entire batch.
+ * In synchronous mode this returns a hash of id => document */
+SV *
+PLCB_op_multi(PLCB_t *object, int cmdbase, SV *ids, SV *options)
+{
+    AV *idav;
+    HV *results;
+    SV *ctxrv;
+    plcb_OPCTX *ctx;
+    I32 ii, nids;
+    union {
+        lcb_CMDBASE base;
+        lcb_CMDGET get;
+        lcb_CMDCOUNTER counter;
+    } u;
+
+    if (!plcb_is_arrayref(ids)) {
+        die("IDs must be an ARRAY reference");
+    }
+
+    memset(&u, 0, sizeof u);
+    PLCB_args_multi(object, cmdbase, options, &u.base);
+
+    idav = (AV *)SvRV(ids);
+    nids = av_len(idav) + 1;
+    results = (HV *)sv_2mortal((SV *)newHV());
+
+    /* Create all the documents first, so we don't die with a half-scheduled
+     * context */
+    for (ii = 0; ii < nids; ii++) {
+        SV **idsv = av_fetch(idav, ii, 0);
+        multi_newdoc(object, results, idsv ? *idsv : &PL_sv_undef);
+    }
+
+    ctxrv = plcb_opctx_new(object, PLCB_OPCTXf_IMPLICIT);
+    SAVEFREESV(ctxrv);
+    ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(ctxrv)));
+
+    for (ii = 0; ii < nids; ii++) {
+        SV *idsv = *av_fetch(idav, ii, 0);
+        AV *docav = (AV *)SvRV(HeVAL(hv_fetch_ent(results, idsv, 0, 0)));
+        plcb_OPSLOT *slot;
+        const char *key;
+        STRLEN nkey;
+
+        if (plcb_doc_get_err(docav) != -1) {
+            continue; /* Duplicate, or empty key */
+        }
+        if (!plcb_inflight_admit(object, docav)) {
+            continue;
+        }
+
+        key = SvPV(idsv, nkey);
+        LCB_CMD_SET_KEY(&u.base, key, nkey);
+        if (object->negcache && cmdbase == PLCB_CMD_COUNTER) {
+            plcb_negcache_remove(object, key, nkey);
+        }
+        slot = plcb_opctx_newslot(ctxrv, docav);
+        multi_adddoc(object, ctx, docav, slot, nkey,
+            multi_schedule(object, cmdbase, slot, &u.base));
+    }
+
+    return multi_finish(object, ctxrv, ctx, results);
+}
+
+/* Stores multiple values. `ids` is either a hash of id => value, or an
+ * array of IDs, in which case `values` is a parallel array of values */
+SV *
+PLCB_op_store_multi(PLCB_t *object, int cmdbase, SV *ids, SV *values, SV *options)
+{
+    HV *results, *seen;
+    AV *idav = NULL, *valav = NULL;
+    SV *ctxrv;
+    plcb_OPCTX *ctx;
+    lcb_CMDSTORE scmd = { 0 };
+    plcb_DOCVAL vspec_base = { 0 }, *vspecs;
+    int durability = 0;
+    I32 ii, nids;
+
+    if (SvROK(ids) && SvTYPE(SvRV(ids)) == SVt_PVHV) {
+        HV *hv = (HV *)SvRV(ids);
+        HE *ent;
+
+        /* Flatten the hash into parallel arrays */
+        idav = (AV *)sv_2mortal((SV *)newAV());
+        valav = (AV *)sv_2mortal((SV *)newAV());
+        hv_iterinit(hv);
+        while ((ent = hv_iternext(hv))) {
+            av_push(idav, SvREFCNT_inc(hv_iterkeysv(ent)));
+            av_push(valav, SvREFCNT_inc(hv_iterval(hv, ent)));
+        }
+
+    } else if (plcb_is_arrayref(ids) && plcb_is_arrayref(values)) {
+        idav = (AV *)SvRV(ids);
+        valav = (AV *)SvRV(values);
+        if (av_len(idav) != av_len(valav)) {
+            die("IDs and values must have the same number of elements");
+        }
+    } else {
+        die("Must pass a HASH reference, or ARRAY references of IDs and values");
+    }
+
+    PLCB_args_store_multi(object, cmdbase, options, &scmd, &vspec_base, &durability);
+    scmd.operation = cmd_to_storop(cmdbase);
+
+    nids = av_len(idav) + 1;
+    results = (HV *)sv_2mortal((SV *)newHV());
+    Newxz(vspecs, nids ? nids : 1, plcb_DOCVAL);
+    SAVEFREEPV(vspecs);
+
+    /* Encode all the values before creating the context, so that an
+     * exception from an encoder does not leave it half-scheduled. The same
+     * structure stored to several IDs is only encoded once */
+    seen = (HV *)sv_2mortal((SV *)newHV());
+    for (ii = 0; ii < nids; ii++) {
+        SV **idsv = av_fetch(idav, ii, 0);
+        SV **valsv = av_fetch(valav, ii, 0);
+        AV *docav = multi_newdoc(object, results, idsv ? *idsv : &PL_sv_undef);
+
+        if (!docav) {
+            continue;
+        }
+        if (valsv == NULL || SvTYPE(*valsv) == SVt_NULL) {
+            die("Must have value!");
+        }
+
+        av_store(docav, PLCB_RETIDX_FMTSPEC, newSVuv(vspec_base.spec));
+        av_store(docav, PLCB_RETIDX_OPTIONS, newSVuv(durability));
+
+        vspecs[ii] = vspec_base;
+        vspecs[ii].value = *valsv;
+        plcb_convert_storage_shared(object, docav, &vspecs[ii], seen);
+        if (vspecs[ii].need_free) {
+            sv_2mortal(vspecs[ii].value);
+            vspecs[ii].need_free = 0;
+        }
+        if (vspecs[ii].encoded == NULL) {
+            die("Invalid value!");
+        }
+    }
+
+    ctxrv = plcb_opctx_new(object, PLCB_OPCTXf_IMPLICIT);
+    SAVEFREESV(ctxrv);
+    ctx = NUM2PTR(plcb_OPCTX*, SvIVX(SvRV(ctxrv)));
+
+    for (ii = 0; ii < nids; ii++) {
+        SV *idsv = *av_fetch(idav, ii, 0);
+        AV *docav = (AV *)SvRV(HeVAL(hv_fetch_ent(results, idsv, 0, 0)));
+        plcb_OPSLOT *slot;
+        const char *key;
+        STRLEN nkey;
+
+        if (vspecs[ii].encoded == NULL || plcb_doc_get_err(docav) != -1) {
+            continue; /* Duplicate, or empty key */
+        }
+        if (!plcb_inflight_admit(object, docav)) {
+            continue;
+        }
+
+        key = SvPV(idsv, nkey);
+        LCB_CMD_SET_KEY(&scmd, key, nkey);
+        LCB_CMD_SET_VALUE(&scmd, vspecs[ii].encoded, vspecs[ii].len);
+        if (object->negcache) {
+            plcb_negcache_remove(object, key, nkey);
+        }
+        scmd.flags = vspecs[ii].flags;
+        slot = plcb_opctx_newslot(ctxrv, docav);
+        multi_adddoc(object, ctx, docav, slot, nkey + vspecs[ii].len,
+            lcb_store3(object->instance, slot, &scmd));
+    }
+
+    return multi_finish(object, ctxrv, ctx, results);
+}
@@ -16,8 +16,6 @@
 #define PLCB_OPCTX_CLASSNAME "Couchbase::OpContext"
 #define PLCB_PUB_CONSTANTS_PKG "Couchbase::Constants"
 #define PLCB_PRIV_CONSTANTS_PKG "Couchbase::_GlueConstants"
-#define PLCB_OBS_PLHELPER "Couchbase::Bucket::__obshelper"
-#define PLCB_STATS_PLHELPER "Couchbase::Bucket::__statshelper"
 #define PLCB_EVENT_CLASS "Couchbase::IO::Event"
 #define PLCB_IOPROCS_CLASS "Couchbase::IO"
 #define PLCB_IOPROCS_CONSTANTS_CLASS "Couchbase::IO::Constants"
@@ -30,6 +28,9 @@
 #include "plcb-util.h"
 
 typedef struct PLCB_st PLCB_t;
+typedef struct plcb_CACHE_st plcb_CACHE;
+typedef struct plcb_NEGCACHE_st plcb_NEGCACHE;
+typedef struct plcb_COMPRESS_st plcb_COMPRESS;
 
 enum {
     PLCB_CONVERTERS_CUSTOM = 1,
@@ -63,7 +64,10 @@ enum {
     PLCB_CMD_KEYSTATS,
     PLCB_CMD_OBSERVE,
     PLCB_CMD_ENDURE,
-    PLCB_CMD_HTTP
+    PLCB_CMD_HTTP,
+    PLCB_CMD_GETREPLICA,
+    PLCB_CMD_LOOKUP_IN,
+    PLCB_CMD_MUTATE_IN
 };
 
 enum {
@@ -75,6 +79,8 @@ enum {
     PLCB_RETIDX_EXP,
     PLCB_RETIDX_FMTSPEC,
     PLCB_RETIDX_CALLBACK,
+    PLCB_RETIDX_TOKEN, /* Mutation token, as [vbucket, uuid, seqno] */
+    PLCB_RETIDX_LAZY, /* Bucket to decode the value with, if not yet decoded */
     PLCB_RETIDX_MAX
 };
 
@@ -110,11 +116,14 @@ enum {
     PLCB_LF_STORABLE = 0x01 << 3,
     PLCB_LF_RAW = 0x03 << 3,
     PLCB_LF_UTF8 = 0x04 << 3,
+    PLCB_LF_SEREAL = 0x05 << 3,
     PLCB_LF_MASK = 0xFF,
 
     PLCB_CF_NONE,
     PLCB_CF_PRIVATE = 0x01 << 24,
     PLCB_CF_STORABLE = PLCB_CF_PRIVATE,
+    /* Sereal is also private to Perl, and told apart by the legacy flags */
+    PLCB_CF_SEREAL = PLCB_CF_PRIVATE | PLCB_LF_SEREAL,
 
     PLCB_CF_JSON = 0x02 << 24,
     PLCB_CF_RAW = 0x03 << 24,
@@ -122,6 +131,15 @@ enum {
     PLCB_CF_MASK = 0xFF << 24
 };
 
+/* Compression is recorded in the compression bits of the common flags
+ * (29-31), which other clients leave unset. The format flags are unchanged,
+ * so once decompressed the value is decoded according to its format as
+ * usual. The ID of the dictionary used, if any, is in the compressed value's
+ * header (see compress.c) */
+#define PLCB_CMPF_LZ4 (0x01U << 29)
+#define PLCB_CMPF_ZSTD (0x02U << 29)
+#define PLCB_CMPF_MASK (0x07U << 29)
+
 enum {
     PLCB_EVIDX_FD,
     PLCB_EVIDX_DUPFH,
@@ -145,6 +163,37 @@ enum {
     PLCB_EVTYPE_TIMER
 };
 
+/* Coalescing of implicit operations in async mode. Operations are left in
+ * the library's scheduling context until one of the limits is reached */
+typedef struct {
+    unsigned maxops; /* 0 if disabled */
+    size_t maxbytes; /* 0 for no limit */
+    lcb_U32 delay; /* Microseconds before pending operations are flushed */
+    unsigned nops; /* Operations waiting to be flushed */
+    size_t nbytes;
+    lcb_timer_t timer;
+} plcb_AUTOBATCH;
+
+/* Limits on operations awaiting a response in async mode. The number of
+ * operations is kept in `npending`. Operations over the limit fail with
+ * LCB_EBUSY rather than being scheduled */
+typedef struct {
+    unsigned maxops; /* 0 for no limit */
+    size_t maxbytes; /* 0 for no limit */
+    size_t nbytes; /* Keys and values sent, but not yet responded to */
+    unsigned long nrejected;
+    int rejecting; /* Operations were rejected since the last drain */
+    SV *on_drain; /* Called once there is room again */
+} plcb_INFLIGHT;
+
+/* Arguments passed to custom converters, reused between calls */
+typedef struct {
+    SV *docrv; /* RV to the document */
+    SV *valrv; /* RV to the value being converted */
+    SV *flagsrv; /* RV to the item flags */
+    int busy; /* A converter is currently running */
+} plcb_CONVARGS;
+
 struct PLCB_st {
     lcb_t instance; /*our library handle*/
     HV *ret_stash; /*stash with which we bless our return objects*/
@@ -165,6 +214,11 @@ struct PLCB_st {
     SV *cv_jsondec;
     SV *cv_customenc;
     SV *cv_customdec;
+    SV *sereal_enc; /* Sereal::Encoder object, if Sereal is installed */
+    SV *sereal_dec; /* Sereal::Decoder object */
+    CV *sereal_enc_cv; /* Sereal::Encoder::encode */
+    CV *sereal_dec_cv; /* Sereal::Decoder::decode */
+    plcb_CONVARGS convargs;
 
     SV *curctx;
     SV *cachectx;
@@ -172,9 +226,23 @@ struct PLCB_st {
     SV *ioprocs;
     SV *udata;
     SV *conncb;
+    plcb_CACHE *cache; /* Read-through cache, if enabled */
+    plcb_NEGCACHE *negcache; /* IDs recently found missing, if enabled */
+    plcb_COMPRESS *compress; /* Value compression, if enabled */
+    int durmode; /* lcb_DURMODE used when checking durability */
+    STRLEN json_encsize; /* Size of the last document from plcb_json_encode */
+    int lazy_decode; /* Keep fetched values undecoded until first accessed */
+    int strict_utf8; /* Validate utf8 and JSON values before flagging them */
+    plcb_AUTOBATCH autobatch;
+    plcb_INFLIGHT inflight;
+    UV nhedged; /* Replica reads issued by hedged gets */
+    UV nhedgewins; /* Hedged gets completed by the replica read */
+    UV nenchits; /* Multi store values which reused an earlier encoding */
+    UV nencmisses; /* Multi store values encoded for sharing */
 
     /*how many operations are pending on this object*/
     int npending;
+    unsigned nqueued; /* Operations in the library's scheduling context */
     int async;
 };
 
@@ -198,13 +266,66 @@ struct PLCB_st {
     plcb_evloop_wait_unref(obj); \
 } while (0);
 
+/* Per-operation cookie passed to the library. This maps the response back
+ * to its document without needing to look it up by key, so the same key may
+ * appear more than once inside a context. */
+typedef struct {
+    SV *ctxrv; /* Context the operation belongs to (not counted) */
+    AV *docav; /* Document. If NULL, the document is looked up by key */
+    unsigned flags;
+    size_t nbytes; /* Counted in `inflight.nbytes` until the first response */
+} plcb_OPSLOT;
+
+/* Slot is the first member of a plcb_HEDGE */
+#define PLCB_OPSLOTf_HEDGE 0x01
+
+/* State for a hedged read. If the active node has not responded within the
+ * threshold, a replica read is issued with the same cookie. The first usable
+ * response completes the document, and the other is discarded. This is
+ * allocated separately from the context's slots as the losing response may
+ * arrive after the context has been reused */
+typedef struct {
+    plcb_OPSLOT slot;
+    lcb_timer_t timer;
+    int npending; /* Responses still expected */
+    int done; /* Document has been completed */
+} plcb_HEDGE;
+
+/* Slots are allocated in blocks and never moved, as their addresses are
+ * handed out as cookies */
+#define PLCB_OPSLOT_BLOCKSIZE 64
+typedef struct plcb_OPSLOTBLOCK_st {
+    struct plcb_OPSLOTBLOCK_st *next;
+    plcb_OPSLOT slots[PLCB_OPSLOT_BLOCKSIZE];
+} plcb_OPSLOTBLOCK;
+
+/* Durability checks for stores within a context which share the same
+ * requirements. These are collected into a single endure context, so that
+ * observe requests for all the documents are batched together */
+typedef struct plcb_DURGROUP_st {
+    struct plcb_DURGROUP_st *next;
+    lcb_MULTICMD_CTX *mctx;
+    AV *docs; /* Documents added to this group */
+    char persist_to;
+    char replicate_to;
+    lcb_U8 pollopts;
+} plcb_DURGROUP;
+
 typedef struct {
     unsigned nremaining;
     unsigned flags;
     int waiting;
-    HV *docs;
+    HV *docs; /* Documents for `multi` operations, keyed by ID */
+    plcb_OPSLOTBLOCK *slots; /* Most recently allocated block */
+    unsigned nslots; /* Number of slots used in the current block */
+    plcb_OPSLOT keyslot; /* Cookie used for `multi` operations */
     SV *parent; /* PLCB_T */
+    SV *selfrv; /* Batch contexts only. Held while operations are outstanding */
     lcb_MULTICMD_CTX *multi;
+    plcb_DURGROUP *durgroups; /* Durability checks not yet submitted */
+    unsigned ndurable; /* Number of documents in `durgroups` */
+    AV *deferred; /* Documents to decode once the context is waited for */
+    SV *decode_many; /* Decodes the JSON values of `deferred` in one call */
     union {
         SV *callback; /* For async only */
         AV *ctxqueue; /* For queued operations */
@@ -218,8 +339,10 @@ typedef struct {
     SV *opctx; /* The context */
     SV *cmdopts; /* Command options */
     SV *docrv; /* Reference for the document */
-    void *cookie;
+    plcb_OPSLOT *cookie;
     plcb_OPCTX *ctxptr;
+    size_t nbytes; /* Size of the key and value, for auto-batching and
+                    * in-flight limits */
 } plcb_SINGLEOP;
 
 /* Temporary structure used for encoding/storing values */
@@ -236,6 +359,8 @@ typedef struct {
 #define PLCB_OPCTXf_CALLEACH 0x02
 #define PLCB_OPCTXf_CALLDONE 0x04
 #define PLCB_OPCTXf_WAITONE 0x08
+#define PLCB_OPCTXf_DEFERDECODE 0x10
+#define PLCB_OPCTXf_SINGLE 0x20 /* Implicit context of a single operation */
 
 /*need to include this after defining PLCB_t*/
 #include "plcb-return.h"
@@ -248,17 +373,66 @@ void plcb_ctor_cbc_opts(AV *options, struct lcb_create_st *cropts);
 void plcb_ctor_conversion_opts(PLCB_t *object, AV *options);
 void plcb_ctor_init_common(PLCB_t *object, lcb_t instance, AV *options);
 
+/* Read-through cache */
+void plcb_cache_configure(PLCB_t *object, unsigned maxitems, NV max_age);
+void plcb_cache_destroy(PLCB_t *object);
+void plcb_cache_clear(PLCB_t *object);
+int plcb_cache_fill(PLCB_t *object, AV *docav, const char *key, size_t nkey);
+void plcb_cache_store(PLCB_t *object, const char *key, size_t nkey,
+    const char *value, size_t nvalue, lcb_U64 cas, lcb_U32 itmflags);
+void plcb_cache_remove(PLCB_t *object, const char *key, size_t nkey);
+HV *plcb_cache_stats(PLCB_t *object);
+void plcb_negcache_configure(PLCB_t *object, unsigned maxitems, NV ttl);
+void plcb_negcache_destroy(PLCB_t *object);
+int plcb_negcache_check(PLCB_t *object, const char *key, size_t nkey);
+void plcb_negcache_add(PLCB_t *object, const char *key, size_t nkey);
+void plcb_negcache_remove(PLCB_t *object, const char *key, size_t nkey);
+
+/* Value compression */
+void plcb_compress_configure(PLCB_t *object, const char *method, size_t min_size, unsigned dict_id);
+void plcb_compress_add_dict(PLCB_t *object, unsigned id, const char *data, size_t len);
+void plcb_compress_destroy(PLCB_t *object);
+SV *plcb_compress_train(PLCB_t *object, AV *samples, size_t dict_size);
+SV *plcb_compress(PLCB_t *object, const char *data, size_t len, lcb_U32 *flags);
+SV *plcb_decompress(PLCB_t *object, const char *data, size_t len, lcb_U32 flags, const char **errp);
+
 /*cleanup functions*/
 void plcb_cleanup(PLCB_t *object);
 
 /*conversion functions*/
+
+/* Do not fall back to "Custom" encoders, and do not compress. Used for
+ * values which are not whole documents */
+#define PLCB_CONVERT_NOCUSTOM 1
+
 void
-plcb_convert_storage(PLCB_t* object, AV *doc, plcb_DOCVAL *vspec);
+plcb_convert_storage_ex(PLCB_t* object, AV *doc, plcb_DOCVAL *vspec, int options);
+#define plcb_convert_storage(obj, doc, vspec) \
+    plcb_convert_storage_ex(obj, doc, vspec, 0)
+
+/* Like plcb_convert_storage, but a structure already stored by the same call
+ * (found in `seen`) reuses its encoding */
+void
+plcb_convert_storage_shared(PLCB_t *object, AV *doc, plcb_DOCVAL *vspec, HV *seen);
 
 void plcb_convert_storage_free(PLCB_t *object, plcb_DOCVAL *vspec);
 
-/* Do not fall back to "Custom" encoders */
-#define PLCB_CONVERT_NOCUSTOM 1
+/* Decodes the value of a lazily fetched document, if it is still pending */
+void plcb_doc_inflate(AV *docav);
+void plcb_doc_inflate_many(PLCB_t *object, AV *docs, SV *decode_many);
+
+/* UTF-8 validation. Returns one of the values below */
+enum {
+    PLCB_UTF8_INVALID = 0,
+    PLCB_UTF8_ASCII, /* Valid, and contains only ASCII */
+    PLCB_UTF8_MULTIBYTE /* Valid, with multi-byte sequences */
+};
+int plcb_utf8_check(const char *buf, size_t len);
+
+/* Built-in JSON codec, used unless a json_encoder/json_decoder is set */
+SV *plcb_json_encode(PLCB_t *object, SV *value);
+SV *plcb_json_decode(const char *buf, size_t len, const char **errp);
+
 SV*
 plcb_convert_retrieval_ex(PLCB_t *object,
     AV *doc, const char *data, size_t data_len, uint32_t flags, int options);
@@ -281,9 +455,25 @@ void plcb_evloop_wait_unref(PLCB_t *obj);
  */
 SV *plcb_opctx_new(PLCB_t *, int);
 void plcb_opctx_clear(PLCB_t *parent);
-void plcb_opctx_initop(plcb_SINGLEOP *so, PLCB_t *parent, SV *doc, SV *ctx, SV *options);
+void plcb_opctx_reset(PLCB_t *parent, plcb_OPCTX *ctx);
+void plcb_opctx_finish(PLCB_t *parent, SV *ctxrv);
+SV *plcb_opctx_hold(PLCB_t *parent, SV *ctxsv);
+void plcb_opctx_wait(PLCB_t *parent, plcb_OPCTX *ctx, int one);
+void plcb_sched_leave(PLCB_t *parent);
+void plcb_sched_fail(PLCB_t *parent);
+int plcb_opctx_initop(plcb_SINGLEOP *so, PLCB_t *parent, SV *doc, SV *ctx, SV *options);
 SV * plcb_opctx_return(plcb_SINGLEOP *so, lcb_error_t err);
 void plcb_opctx_submit(PLCB_t *parent, plcb_OPCTX *ctx);
+SV *plcb_opctx_return_local(plcb_SINGLEOP *so);
+plcb_OPSLOT *plcb_opctx_newslot(SV *ctxrv, AV *docav);
+size_t plcb_opctx_release_slots(plcb_OPCTX *ctx);
+void plcb_opctx_release_durability(plcb_OPCTX *ctx);
+void plcb_opctx_decode_deferred(PLCB_t *parent, plcb_OPCTX *ctx);
+void plcb_autobatch_configure(PLCB_t *parent, unsigned maxops, size_t maxbytes, lcb_U32 delay);
+void plcb_autobatch_flush(PLCB_t *parent);
+int plcb_inflight_admit(PLCB_t *parent, AV *docav);
+void plcb_inflight_add(PLCB_t *parent, plcb_OPSLOT *slot, size_t nbytes);
+void plcb_inflight_drain(PLCB_t *parent);
 
 #define plcb_opctx_is_cmd_multi(cmd) \
     ((cmd) == PLCB_CMD_OBSERVE || (cmd) == PLCB_CMD_STATS)
@@ -300,6 +490,12 @@ SV *PLCB_op_stats(PLCB_t *object, plcb_SINGLEOP *args);
 SV *PLCB_op_observe(PLCB_t *object, plcb_SINGLEOP *args);
 SV *PLCB_op_endure(PLCB_t *object, plcb_SINGLEOP *opinfo);
 SV* PLCB_op_http(PLCB_t *object, plcb_SINGLEOP *opinfo);
+SV *PLCB_op_get_replica(PLCB_t *object, plcb_SINGLEOP *opinfo);
+SV *PLCB_op_subdoc(PLCB_t *object, plcb_SINGLEOP *opinfo);
+SV *PLCB_op_dispatch(PLCB_t *object, plcb_SINGLEOP *opinfo);
+void plcb_hedge_cancel(PLCB_t *object, plcb_HEDGE *hedge);
+SV *PLCB_op_multi(PLCB_t *object, int cmdbase, SV *ids, SV *options);
+SV *PLCB_op_store_multi(PLCB_t *object, int cmdbase, SV *ids, SV *values, SV *options);
 
 SV *
 PLCB_args_return(plcb_SINGLEOP *so, lcb_error_t err);
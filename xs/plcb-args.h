@@ -45,6 +45,16 @@ typedef struct {
 #define PLCB_ARG_K_FMT "format"
 #define PLCB_ARG_K_MASTERONLY "master_only"
 #define PLCB_ARG_K_ISDELETE "is_remove"
+#define PLCB_ARG_K_STRATEGY "strategy"
+#define PLCB_ARG_K_INDEX "index"
+#define PLCB_ARG_K_HEDGE "hedge_after"
+#define PLCB_ARG_K_SPEC "spec"
+#define PLCB_ARG_K_MKPARENTS "create_parents"
+#define PLCB_ARG_K_DURMODE "durability_mode"
+#define PLCB_ARG_K_LAZYDECODE "lazy_decode"
+#define PLCB_ARG_K_STRICTUTF8 "strict_utf8"
+#define PLCB_ARG_K_DECODE "decode"
+#define PLCB_ARG_K_DECODEMANY "decode_many"
 
 #define PLCB_KWARG(s, tbase, target) \
 { s, sizeof(s)-1, PLCB_ARG_T_##tbase, target }
@@ -54,7 +64,7 @@ typedef struct {
 int
 plcb_extract_args(SV *sv, plcb_OPTION *values);
 
-int PLCB_args_get(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDGET *gcmd);
+int PLCB_args_get(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDGET *gcmd, lcb_U32 *hedge_us);
 int PLCB_args_remove(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDREMOVE *rcmd);
 int PLCB_args_arithmetic(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDCOUNTER *cmd);
 int PLCB_args_unlock(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDUNLOCK *cmd);
@@ -62,5 +72,10 @@ int PLCB_args_set(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDSTORE *cmd, plcb_D
 int PLCB_args_observe(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDOBSERVE *cmd);
 #define PLCB_args_endure PLCB_args_unlock
 int PLCB_args_http(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDHTTP *htcmd);
+SV *PLCB_args_subdoc(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDSUBDOC *cmd);
+int PLCB_args_get_replica(PLCB_t *object, plcb_SINGLEOP *args, lcb_CMDGETREPLICA *rcmd);
+int PLCB_args_multi(PLCB_t *object, int cmdbase, SV *options, lcb_CMDBASE *cmd);
+int PLCB_args_store_multi(PLCB_t *object, int cmdbase, SV *options,
+    lcb_CMDSTORE *scmd, plcb_DOCVAL *vspec, int *durability);
 
 #endif /* PLCB_KWARGS_H_ */
@@ -14,6 +14,30 @@
 #define plcb_doc_set_cas(obj, ret, cas) \
     av_store(ret, PLCB_RETIDX_CAS, plcb_sv_from_u64_new(cas) );
 
+/* Stores a fetched value without decoding it. The value holds the raw bytes
+ * and the format holds the item flags, until plcb_doc_inflate() is called */
+static inline void
+plcb_doc_set_lazy(PLCB_t *obj, AV *ret, const void *value, size_t nvalue, lcb_U32 flags)
+{
+    av_store(ret, PLCB_RETIDX_VALUE, newSVpvn(value, nvalue));
+    sv_setuv(*av_fetch(ret, PLCB_RETIDX_FMTSPEC, 1), flags);
+    av_store(ret, PLCB_RETIDX_LAZY, newRV_inc(obj->selfobj));
+}
+
+static inline int
+plcb_doc_is_lazy(AV *ret)
+{
+    SV **tmp = av_fetch(ret, PLCB_RETIDX_LAZY, 0);
+    return tmp != NULL && SvROK(*tmp);
+}
+
+/* Called when a document gets a decoded value, in case it was lazy before */
+#define plcb_doc_clear_lazy(ret) do { \
+    if (plcb_doc_is_lazy(ret)) { \
+        av_delete(ret, PLCB_RETIDX_LAZY, G_DISCARD); \
+    } \
+} while (0)
+
 static inline void
 plcb_doc_set_numval(PLCB_t *obj, AV *ret, uint64_t value, uint64_t cas)
 {
@@ -28,6 +52,7 @@ plcb_doc_set_numval(PLCB_t *obj, AV *ret, uint64_t value, uint64_t cas)
     }
 #endif
     av_store(ret, PLCB_RETIDX_VALUE, isv);
+    plcb_doc_clear_lazy(ret);
     plcb_doc_set_cas(obj, ret, &cas);
 }
 
@@ -48,6 +73,58 @@ plcb_doc_get_err(AV *ret)
     return SvIVX(*ivsv);
 }
 
+static inline lcb_U32
+plcb_doc_get_fmtspec(AV *ret)
+{
+    SV **fmtsv = av_fetch(ret, PLCB_RETIDX_FMTSPEC, 0);
+    if (fmtsv == NULL || SvIOK(*fmtsv) == 0) {
+        return 0;
+    }
+    return SvUVX(*fmtsv);
+}
+
+static inline void
+plcb_doc_set_token(PLCB_t *obj, AV *ret, const lcb_MUTATION_TOKEN *token)
+{
+    AV *tokav;
+    lcb_U64 uuid, seqno;
+
+    if (!LCB_MUTATION_TOKEN_ISVALID(token)) {
+        av_delete(ret, PLCB_RETIDX_TOKEN, G_DISCARD);
+        return;
+    }
+
+    uuid = LCB_MUTATION_TOKEN_ID(token);
+    seqno = LCB_MUTATION_TOKEN_SEQ(token);
+    tokav = newAV();
+    av_push(tokav, newSVuv(LCB_MUTATION_TOKEN_VB(token)));
+    av_push(tokav, plcb_sv_from_u64_new(&uuid));
+    av_push(tokav, plcb_sv_from_u64_new(&seqno));
+    av_store(ret, PLCB_RETIDX_TOKEN, newRV_noinc((SV *)tokav));
+    (void)obj;
+}
+
+/* Reads the document's mutation token. Returns false if it has none */
+static inline int
+plcb_doc_get_token(AV *ret, lcb_MUTATION_TOKEN *token)
+{
+    SV **tmp = av_fetch(ret, PLCB_RETIDX_TOKEN, 0);
+    AV *tokav;
+
+    if (tmp == NULL || !SvROK(*tmp) || SvTYPE(SvRV(*tmp)) != SVt_PVAV) {
+        return 0;
+    }
+    tokav = (AV *)SvRV(*tmp);
+    if (av_len(tokav) != 2) {
+        return 0;
+    }
+
+    token->vbid_ = SvUV(*av_fetch(tokav, 0, 1));
+    token->uuid_ = plcb_sv_to_u64(*av_fetch(tokav, 1, 1));
+    token->seqno_ = plcb_sv_to_u64(*av_fetch(tokav, 2, 1));
+    return 1;
+}
+
 #define plcb_ret_blessed_rv(obj, ret) \
     sv_bless(newRV_noinc( (SV*)(ret)), (obj)->ret_stash)
 
@@ -0,0 +1,263 @@
+/* UTF-8 validation of values, used for the utf8 and JSON formats when the
+ * bucket was created with `strict_utf8`, and to avoid upgrading plain ASCII
+ * strings when storing.
+ *
+ * Valid means well-formed as defined by the Unicode standard: no overlong
+ * forms, no surrogates and nothing above U+10FFFF.
+ *
+ * On x86-64 the AVX2 implementation of the "lookup" algorithm (Keiser and
+ * Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte") is used
+ * if the CPU supports it. Otherwise blocks of ASCII are skipped 16 bytes at a
+ * time with SSE2 and the remainder is checked one sequence at a time. */
+
+#if defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define PLCB_UTF8_X86
+#include <immintrin.h>
+#endif
+
+#include "perl-couchbase.h"
+
+#define IS_CONT(c) (((c) & 0xC0) == 0x80)
+
+/* Returns the length of the well-formed sequence at `s`, or 0 */
+static size_t
+seq_len(const unsigned char *s, const unsigned char *end)
+{
+    unsigned char c = s[0];
+    size_t avail = end - s;
+
+    if (c < 0x80) {
+        return 1;
+    } else if (c < 0xC2) {
+        return 0;
+    } else if (c < 0xE0) {
+        return avail >= 2 && IS_CONT(s[1]) ? 2 : 0;
+    } else if (c < 0xF0) {
+        if (avail < 3 || !IS_CONT(s[1]) || !IS_CONT(s[2])) {
+            return 0;
+        }
+        if ((c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] > 0x9F)) {
+            return 0; /* Overlong, or a surrogate */
+        }
+        return 3;
+    } else if (c < 0xF5) {
+        if (avail < 4 || !IS_CONT(s[1]) || !IS_CONT(s[2]) || !IS_CONT(s[3])) {
+            return 0;
+        }
+        if ((c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] > 0x8F)) {
+            return 0; /* Overlong, or above U+10FFFF */
+        }
+        return 4;
+    }
+    return 0;
+}
+
+static int
+check_scalar(const unsigned char *s, const unsigned char *end, int multibyte)
+{
+    while (s < end) {
+        size_t n;
+
+        /* Skip ASCII a word at a time */
+        while ((size_t)(end - s) >= sizeof(size_t)) {
+            size_t w;
+            memcpy(&w, s, sizeof w);
+            if (w & ((size_t)-1 / 0xFF * 0x80)) {
+                break;
+            }
+            s += sizeof w;
+        }
+        if (s == end) {
+            break;
+        }
+        if (*s < 0x80) {
+            s++;
+            continue;
+        }
+        if ((n = seq_len(s, end)) == 0) {
+            return PLCB_UTF8_INVALID;
+        }
+        multibyte = 1;
+        s += n;
+    }
+    return multibyte ? PLCB_UTF8_MULTIBYTE : PLCB_UTF8_ASCII;
+}
+
+#ifdef PLCB_UTF8_X86
+static int
+check_sse2(const unsigned char *s, const unsigned char *end)
+{
+    int multibyte = 0;
+
+    while (end - s >= 16) {
+        const unsigned char *blkend = s + 16;
+        __m128i blk = _mm_loadu_si128((const __m128i *)s);
+
+        if (_mm_movemask_epi8(blk) == 0) {
+            s = blkend;
+            continue;
+        }
+
+        /* Sequences may run past the end of the block */
+        multibyte = 1;
+        while (s < blkend) {
+            size_t n = seq_len(s, end);
+            if (n == 0) {
+                return PLCB_UTF8_INVALID;
+            }
+            s += n;
+        }
+    }
+    return check_scalar(s, end, multibyte);
+}
+
+/* Error bits for a pair of adjacent bytes. See the paper for how these
+ * tables are derived */
+#define E_TOO_SHORT (1 << 0) /* Lead byte not followed by a continuation */
+#define E_TOO_LONG (1 << 1) /* ASCII followed by a continuation */
+#define E_OVERLONG_3 (1 << 2)
+#define E_TOO_LARGE (1 << 3)
+#define E_SURROGATE (1 << 4)
+#define E_OVERLONG_2 (1 << 5)
+#define E_TOO_LARGE_1000 (1 << 6)
+#define E_OVERLONG_4 (1 << 6)
+#define E_TWO_CONTS (1 << 7) /* Valid only as the 3rd or 4th byte */
+#define E_CARRY (E_TOO_SHORT | E_TOO_LONG | E_TWO_CONTS)
+
+#define LOOKUP16(a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p) \
+    _mm256_setr_epi8(a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p,a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p)
+
+__attribute__((target("avx2")))
+static __m256i
+avx2_check_block(__m256i input, __m256i prev_input)
+{
+    const __m256i nib = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high_tbl = LOOKUP16(
+        E_TOO_LONG, E_TOO_LONG, E_TOO_LONG, E_TOO_LONG,
+        E_TOO_LONG, E_TOO_LONG, E_TOO_LONG, E_TOO_LONG,
+        E_TWO_CONTS, E_TWO_CONTS, E_TWO_CONTS, E_TWO_CONTS,
+        E_TOO_SHORT | E_OVERLONG_2,
+        E_TOO_SHORT,
+        E_TOO_SHORT | E_OVERLONG_3 | E_SURROGATE,
+        E_TOO_SHORT | E_TOO_LARGE | E_TOO_LARGE_1000 | E_OVERLONG_4);
+    const __m256i byte_1_low_tbl = LOOKUP16(
+        E_CARRY | E_OVERLONG_3 | E_OVERLONG_2 | E_OVERLONG_4,
+        E_CARRY | E_OVERLONG_2,
+        E_CARRY,
+        E_CARRY,
+        E_CARRY | E_TOO_LARGE,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000 | E_SURROGATE,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000,
+        E_CARRY | E_TOO_LARGE | E_TOO_LARGE_1000);
+    const __m256i byte_2_high_tbl = LOOKUP16(
+        E_TOO_SHORT, E_TOO_SHORT, E_TOO_SHORT, E_TOO_SHORT,
+        E_TOO_SHORT, E_TOO_SHORT, E_TOO_SHORT, E_TOO_SHORT,
+        E_TOO_LONG | E_OVERLONG_2 | E_TWO_CONTS | E_OVERLONG_3 | E_TOO_LARGE_1000 | E_OVERLONG_4,
+        E_TOO_LONG | E_OVERLONG_2 | E_TWO_CONTS | E_OVERLONG_3 | E_TOO_LARGE,
+        E_TOO_LONG | E_OVERLONG_2 | E_TWO_CONTS | E_SURROGATE | E_TOO_LARGE,
+        E_TOO_LONG | E_OVERLONG_2 | E_TWO_CONTS | E_SURROGATE | E_TOO_LARGE,
+        E_TOO_SHORT, E_TOO_SHORT, E_TOO_SHORT, E_TOO_SHORT);
+
+    /* The input shifted right by 1, 2 and 3 bytes, continuing from the
+     * previous block */
+    __m256i carried = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, carried, 16 - 1);
+    __m256i prev2 = _mm256_alignr_epi8(input, carried, 16 - 2);
+    __m256i prev3 = _mm256_alignr_epi8(input, carried, 16 - 3);
+    __m256i sc, must23;
+
+    sc = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte_1_high_tbl,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib)),
+            _mm256_shuffle_epi8(byte_1_low_tbl, _mm256_and_si256(prev1, nib))),
+        _mm256_shuffle_epi8(byte_2_high_tbl,
+            _mm256_and_si256(_mm256_srli_epi16(input, 4), nib)));
+
+    /* Bytes two or three after a 3 or 4 byte lead must be continuations.
+     * Those are exactly the positions where TWO_CONTS is expected */
+    must23 = _mm256_or_si256(
+        _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+        _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+    must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, sc);
+}
+
+__attribute__((target("avx2")))
+static int
+check_avx2(const unsigned char *s, const unsigned char *end)
+{
+    /* Nonzero where the last bytes of a block begin a sequence which
+     * continues into the next block */
+    const __m256i max_complete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    const unsigned char *start = s;
+    int multibyte = 0;
+
+    for (; end - s >= 32; s += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i *)s);
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = _mm256_setzero_si256();
+        } else {
+            multibyte = 1;
+            error = _mm256_or_si256(error, avx2_check_block(input, prev_input));
+            prev_incomplete = _mm256_subs_epu8(input, max_complete);
+        }
+        prev_input = input;
+    }
+
+    if (!_mm256_testz_si256(error, error)) {
+        return PLCB_UTF8_INVALID;
+    }
+
+    /* Re-check a sequence which was cut off at the end of the last block,
+     * along with the remaining bytes */
+    if (s > start) {
+        const unsigned char *p;
+        for (p = s - 1; p >= s - 3 && p >= start; p--) {
+            if (*p >= 0xC0) {
+                s = p;
+                break;
+            }
+        }
+    }
+    return check_scalar(s, end, multibyte);
+}
+
+static int have_avx2 = -1;
+#endif /* PLCB_UTF8_X86 */
+
+int
+plcb_utf8_check(const char *buf, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)buf;
+
+#ifdef PLCB_UTF8_X86
+    if (len >= 32) {
+        if (have_avx2 == -1) {
+            __builtin_cpu_init();
+            have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        }
+        if (have_avx2) {
+            return check_avx2(s, s + len);
+        }
+    }
+    return check_sse2(s, s + len);
+#else
+    return check_scalar(s, s + len, 0);
+#endif
+}